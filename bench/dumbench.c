@@ -0,0 +1,188 @@
+#define _DEFAULT_SOURCE
+
+#include "ast.h"
+#include "codegen.h"
+#include "lex.h"
+#include "parse.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs the single threaded compiler over a file phase by phase and prints the
+// timings as JSON. Every run is a fresh process, so the peak RSS is that of
+// one compile and the intern table starts out empty each time.
+
+#define RUNS 5
+
+typedef struct _run {
+  size_t tokens;
+  size_t funcs;
+  size_t nodes;
+  double lex;
+  double parse;
+  double codegen;
+  double elf_write;
+} run_t;
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+char *read_file(const char *path, size_t *len) {
+  FILE *fd = fopen(path, "r");
+  if (fd == NULL)
+    err(EXIT_FAILURE, "failed to open '%s'", path);
+  fseek(fd, 0, SEEK_END);
+  *len = (size_t)ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+  char *buf = malloc(*len);
+  if (fread(buf, 1, *len, fd) != *len)
+    err(EXIT_FAILURE, "failed to read '%s'", path);
+  fclose(fd);
+  return buf;
+}
+
+run_t compile(const char *src, size_t len, const char *object) {
+  run_t run = {0};
+
+  double start = now();
+  token_array_t *tokens = parse_tokens(src, len);
+  run.lex = now() - start;
+  run.tokens = tokens->len;
+
+  start = now();
+  ast_t ast;
+  ast_init(&ast);
+  set_token_array(tokens);
+  parse_set_ast(&ast);
+  if (!try_parse_ast())
+    errx(EXIT_FAILURE, "error: %s", parse_error());
+  run.parse = now() - start;
+  run.funcs = ast.funcs.len;
+  run.nodes = ast.len;
+
+  start = now();
+  gen_begin();
+  for (size_t i = 0; i < ast.funcs.len; ++i)
+    gen_func(&ast, ast.funcs.data[i]);
+  run.codegen = now() - start;
+
+  start = now();
+  gen_end(object);
+  run.elf_write = now() - start;
+
+  ast_free(&ast);
+  token_array_free(tokens);
+  return run;
+}
+
+// Compiles in a child, hands back its timings and its peak RSS in KiB
+run_t compile_child(const char *src, size_t len, const char *object,
+                    long *max_rss) {
+  int fds[2];
+  if (pipe(fds) < 0)
+    err(EXIT_FAILURE, "failed to create pipe");
+
+  pid_t pid = fork();
+  if (pid < 0)
+    err(EXIT_FAILURE, "failed to fork");
+  if (pid == 0) {
+    close(fds[0]);
+    run_t run = compile(src, len, object);
+    if (write(fds[1], &run, sizeof(run)) != sizeof(run))
+      err(EXIT_FAILURE, "failed to report run");
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  run_t run;
+  ssize_t n = read(fds[0], &run, sizeof(run));
+  close(fds[0]);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0)
+    err(EXIT_FAILURE, "failed to wait for compile");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || n != sizeof(run))
+    errx(EXIT_FAILURE, "compile failed");
+  *max_rss = usage.ru_maxrss;
+  return run;
+}
+
+double min(double a, double b) { return a < b ? a : b; }
+
+int main(int argc, char **argv) {
+  const char *object = "bench.o";
+  int runs = RUNS;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:r:")) != -1) {
+    switch (opt) {
+    case 'o':
+      object = optarg;
+      break;
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: dumbench [-r runs] [-o object] file\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind + 1 != argc || runs < 1) {
+    fprintf(stderr, "usage: dumbench [-r runs] [-o object] file\n");
+    return EXIT_FAILURE;
+  }
+
+  const char *path = argv[optind];
+  size_t len;
+  char *src = read_file(path, &len);
+
+  // Phases are timed separately, each gets the best of its runs
+  run_t best;
+  long peak_rss = 0;
+  for (int i = 0; i < runs; ++i) {
+    long rss;
+    run_t run = compile_child(src, len, object, &rss);
+    if (rss > peak_rss)
+      peak_rss = rss;
+    if (i == 0) {
+      best = run;
+      continue;
+    }
+    best.lex = min(best.lex, run.lex);
+    best.parse = min(best.parse, run.parse);
+    best.codegen = min(best.codegen, run.codegen);
+    best.elf_write = min(best.elf_write, run.elf_write);
+  }
+
+  double total = best.lex + best.parse + best.codegen + best.elf_write;
+  printf("{\n"
+         "  \"file\": \"%s\",\n"
+         "  \"runs\": %d,\n"
+         "  \"bytes\": %zu,\n"
+         "  \"tokens\": %zu,\n"
+         "  \"functions\": %zu,\n"
+         "  \"nodes\": %zu,\n"
+         "  \"lex_s\": %.6f,\n"
+         "  \"parse_s\": %.6f,\n"
+         "  \"codegen_s\": %.6f,\n"
+         "  \"elf_write_s\": %.6f,\n"
+         "  \"total_s\": %.6f,\n"
+         "  \"tokens_per_s\": %.0f,\n"
+         "  \"peak_rss_kb\": %ld\n"
+         "}\n",
+         path, runs, len, best.tokens, best.funcs, best.nodes, best.lex,
+         best.parse, best.codegen, best.elf_write, total,
+         (double)best.tokens / (best.lex + best.parse), peak_rss);
+
+  free(src);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Writes a large, valid .dum program to stdout. Every knob stresses a
+// different part of the front end:
+//   -f  number of functions, each calling the one before it
+//   -d  nesting depth of the arithmetic expression in every function
+//   -c  length of the if chain in every function
+//   -w  operands of the boolean expression in every condition
+//   -s  seed, the same seed and knobs always give the same program
+
+unsigned int funcs = 2000;
+unsigned int depth = 6;
+unsigned int chain = 8;
+unsigned int width = 4;
+unsigned long seed = 1;
+
+unsigned int next_rand() {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (unsigned int)(seed >> 33);
+}
+
+// Identifiers can't hold digits
+void print_name(const char *prefix, unsigned int n) {
+  fputs(prefix, stdout);
+  do {
+    putchar((int)('a' + n % 26));
+    n /= 26;
+  } while (n != 0);
+}
+
+const char *vars[] = {"a", "b", "c", "x"};
+const char *arith_ops[] = {"+", "-", "*"};
+const char *cmp_ops[] = {"<", ">", "<=", ">=", "==", "!="};
+
+// x can't be used until it's declared
+unsigned int nvars = 3;
+
+void print_operand() {
+  if (next_rand() % 3 == 0)
+    printf("%u", next_rand() % 1000);
+  else
+    fputs(vars[next_rand() % nvars], stdout);
+}
+
+// Left leaning, so it nests deeply without needing a register per level
+void print_arith(unsigned int level) {
+  if (level == 0) {
+    print_operand();
+    return;
+  }
+  putchar('(');
+  print_arith(level - 1);
+  printf(" %s ", arith_ops[next_rand() % 3]);
+  print_operand();
+  putchar(')');
+}
+
+void print_cond() {
+  for (unsigned int i = 0; i < width; ++i) {
+    if (i != 0)
+      fputs(next_rand() % 2 ? " && " : " || ", stdout);
+    if (next_rand() % 4 == 0)
+      putchar('!');
+    putchar('(');
+    print_operand();
+    printf(" %s ", cmp_ops[next_rand() % 6]);
+    print_operand();
+    putchar(')');
+  }
+}
+
+void print_func(unsigned int f) {
+  putchar('@');
+  print_name("f", f);
+  printf("(a: int, b: int, c: int) {\n");
+
+  nvars = 3;
+  printf("    dec x: int = ");
+  print_arith(depth);
+  putchar('\n');
+  nvars = 4;
+
+  for (unsigned int i = 0; i < chain; ++i) {
+    printf("    if ");
+    print_cond();
+    printf(" {\n        x = x %s ", arith_ops[next_rand() % 3]);
+    print_operand();
+    printf("\n    }\n");
+  }
+
+  printf("    while ");
+  print_cond();
+  printf(" {\n        x = x - 1\n    }\n");
+
+  if (f != 0) {
+    printf("    x = x + ");
+    print_name("f", f - 1);
+    printf("(a, b, x)\n");
+  }
+  printf("    ret x\n}\n\n");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "f:d:c:w:s:")) != -1) {
+    switch (opt) {
+    case 'f':
+      funcs = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      depth = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      chain = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      width = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr,
+              "usage: gendum [-f funcs] [-d depth] [-c chain] [-w width] "
+              "[-s seed]\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (width == 0)
+    width = 1;
+
+  for (unsigned int f = 0; f < funcs; ++f)
+    print_func(f);
+  return EXIT_SUCCESS;
+}
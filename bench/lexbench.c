@@ -0,0 +1,89 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lex.h"
+#include "scan.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUNS 5
+#define SYNTH_SIZE (32 << 20)
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+char *read_file(const char *path, size_t *len) {
+  FILE *fd = fopen(path, "r");
+  if (fd == NULL)
+    err(EXIT_FAILURE, "failed to open '%s'", path);
+  fseek(fd, 0, SEEK_END);
+  *len = (size_t)ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+  char *buf = malloc(*len);
+  if (fread(buf, 1, *len, fd) != *len)
+    err(EXIT_FAILURE, "failed to read '%s'", path);
+  fclose(fd);
+  return buf;
+}
+
+// Machine generated style: deep indentation and long identifiers
+char *synth_source(size_t *len) {
+  char *buf = malloc(SYNTH_SIZE + 256);
+  size_t n = 0;
+  for (unsigned int f = 0; n < SYNTH_SIZE; ++f) {
+    n += (size_t)sprintf(buf + n, "@generated_function_number_%c%c(param: int) {\n",
+                         'a' + f % 26, 'a' + f / 26 % 26);
+    for (unsigned int i = 0; i < 16 && n < SYNTH_SIZE; ++i) {
+      n += (size_t)sprintf(buf + n,
+                           "%*sdec accumulated_intermediate_value_%c: int = "
+                           "param * %u + 1234567 - accumulator_register\n",
+                           (int)(4 + i % 8 * 4), "", 'a' + i, i * 7919);
+    }
+    n += (size_t)sprintf(buf + n, "    ret param\n}\n\n");
+  }
+  *len = n;
+  return buf;
+}
+
+void bench(scan_impl_t impl, const char *src, size_t len) {
+  if (scan_select(impl) != impl)
+    return;
+
+  double best = 0;
+  size_t ntokens = 0;
+  for (int i = 0; i < RUNS; ++i) {
+    double start = now();
+    token_array_t *tokens = parse_tokens(src, len);
+    double elapsed = now() - start;
+    ntokens = tokens->len;
+    token_array_free(tokens);
+    if (i == 0 || elapsed < best)
+      best = elapsed;
+  }
+  printf("%-8s %10.1f MB/s %12.1f Mtok/s  (%zu tokens)\n",
+         scan_impl_names[impl], (double)len / best / 1e6,
+         (double)ntokens / best / 1e6, ntokens);
+}
+
+int main(int argc, char **argv) {
+  size_t len;
+  char *src;
+  if (argc > 1)
+    src = read_file(argv[1], &len);
+  else
+    src = synth_source(&len);
+
+  printf("lexing %.1f MB, best of %d runs\n", (double)len / 1e6, RUNS);
+  bench(SCAN_SCALAR, src, len);
+  bench(SCAN_SSE2, src, len);
+  bench(SCAN_AVX2, src, len);
+
+  free(src);
+  return EXIT_SUCCESS;
+}
@@ -2,6 +2,8 @@
 #include <stdio.h>
 
 extern int64_t dumlang(int64_t a);
+extern int64_t fold(int64_t x);
+extern int64_t spill(int64_t p);
 
 int64_t dumlang_test(int64_t param) {
   int64_t i = 0;
@@ -23,4 +25,19 @@ int main() {
   for (int64_t i = -20; i < 20; ++i) {
     printf("%ld: \t %ld \t %ld\n", i, dumlang(i), dumlang_test(i));
   }
+  for (int64_t i = -20; i < 20; ++i) {
+    if (fold(i) != i) {
+      printf("fold(%ld) = %ld\n", i, fold(i));
+      return 1;
+    }
+  }
+  const int64_t spilled[] = {-1577685244, -1615808572, -1581514620,
+                              -1462269628, -1245539836, -918791484,
+                              -469490812};
+  for (int64_t i = 0; i < 7; ++i) {
+    if (spill(i - 3) != spilled[i]) {
+      printf("spill(%ld) = %ld\n", i - 3, spill(i - 3));
+      return 1;
+    }
+  }
 }
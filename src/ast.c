@@ -0,0 +1,75 @@
+#include "ast.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+void ast_init(ast_t *ast) { memset(ast, 0, sizeof(ast_t)); }
+
+void ast_free(ast_t *ast) {
+  free(ast->kind);
+  free(ast->op);
+  free(ast->lhs);
+  free(ast->rhs);
+  VEC_FREE(ast->extra);
+  VEC_FREE(ast->funcs);
+  ast_init(ast);
+}
+
+void ast_reset(ast_t *ast) {
+  ast->len = 0;
+  ast->extra.len = 0;
+  ast->funcs.len = 0;
+}
+
+ast_mark_t ast_mark(const ast_t *ast) {
+  return (ast_mark_t){.len = ast->len,
+                      .extra_len = ast->extra.len,
+                      .funcs_len = ast->funcs.len};
+}
+
+void ast_rollback(ast_t *ast, ast_mark_t mark) {
+  ast->len = mark.len;
+  ast->extra.len = mark.extra_len;
+  ast->funcs.len = mark.funcs_len;
+}
+
+#define GROW(ARRAY, CAP)                                                       \
+  do {                                                                         \
+    (ARRAY) = realloc((ARRAY), (CAP) * sizeof(*(ARRAY)));                      \
+    if ((ARRAY) == NULL)                                                       \
+      err(EXIT_FAILURE, "failed to grow the AST");                             \
+  } while (0)
+
+node_t ast_add(ast_t *ast, node_kind_t kind, uint8_t op, uint32_t lhs,
+               uint32_t rhs) {
+  if (ast->len == ast->cap) {
+    ast->cap = ast->cap == 0 ? 1024 : ast->cap * 2;
+    if (ast->cap > NODE_NONE)
+      errx(EXIT_FAILURE, "too many nodes in the AST");
+    GROW(ast->kind, ast->cap);
+    GROW(ast->op, ast->cap);
+    GROW(ast->lhs, ast->cap);
+    GROW(ast->rhs, ast->cap);
+  }
+  node_t node = (node_t)ast->len++;
+  ast->kind[node] = kind;
+  ast->op[node] = op;
+  ast->lhs[node] = lhs;
+  ast->rhs[node] = rhs;
+  return node;
+}
+
+node_t ast_add_num(ast_t *ast, int64_t value) {
+  return ast_add(ast, NODE_NUM, 0, (uint32_t)value,
+                 (uint32_t)((uint64_t)value >> 32));
+}
+
+uint32_t ast_add_extra(ast_t *ast, const uint32_t *values, size_t count) {
+  uint32_t start = (uint32_t)ast->extra.len;
+  VEC_RESERVE(ast->extra, count);
+  if (count != 0)
+    memcpy(ast->extra.data + ast->extra.len, values, count * sizeof(uint32_t));
+  ast->extra.len += count;
+  return start;
+}
@@ -0,0 +1,180 @@
+#ifndef _AST_H
+#define _AST_H
+
+#include "intern.h"
+#include "vec.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Nodes are indices into the arrays of an ast_t, children are referenced by
+// index too so a tree is a handful of flat arrays. A node is always added
+// after its children and its earlier siblings, so within a function node
+// order is the order code runs in.
+typedef uint32_t node_t;
+
+#define NODE_NONE UINT32_MAX
+
+typedef enum _type : uint8_t {
+  TYPE_NONE,
+  TYPE_INT64,
+} type_t;
+
+typedef enum _arith_operator : uint8_t {
+  ARITH_OP_ADD,
+  ARITH_OP_SUB,
+  ARITH_OP_MUL,
+  ARITH_OP_DIV
+} arith_operator_t;
+
+typedef enum _bool_operator : uint8_t {
+  BOOL_OP_AND,
+  BOOL_OP_OR,
+  BOOL_OP_NOT
+} bool_operator_t;
+
+typedef enum _cmp_operator : uint8_t {
+  CMP_OP_LT,
+  CMP_OP_GT,
+  CMP_OP_LTE,
+  CMP_OP_GTE,
+  CMP_OP_EQU,
+  CMP_OP_NEQ,
+} cmp_operator_t;
+
+// What op, lhs and rhs hold for every kind of node. Lists (statements,
+// arguments) live in extra, the node keeps where they start.
+typedef enum _node_kind : uint8_t {
+  // Arithmetic expressions
+  NODE_NUM,   // lhs, rhs: low and high 32 bits of the value
+  NODE_IDENT, // lhs: ident_t
+  NODE_CALL,  // lhs: ident_t, rhs: extra index of argc followed by the args
+  NODE_ARITH, // op: arith_operator_t, lhs, rhs: operands
+  NODE_PAREN, // lhs: arithmetic expression
+
+  // Boolean expressions
+  NODE_CMP,   // op: cmp_operator_t, lhs, rhs: arithmetic operands
+  NODE_BOOL,  // op: bool_operator_t, lhs, rhs: operands, no rhs for NOT
+  NODE_GROUP, // lhs: boolean expression
+
+  // Statements, any expression is a statement on its own as well
+  NODE_DECLARE, // op: type_t, lhs: ident_t, rhs: value
+  NODE_ASSIGN,  // lhs: ident_t, rhs: value
+  NODE_RET,     // lhs: value
+  NODE_IF,      // lhs: condition, rhs: block
+  NODE_WHILE,   // lhs: condition, rhs: block
+  NODE_CONT,
+  NODE_BREAK,
+  NODE_BLOCK, // lhs: extra index of the first statement, rhs: count
+
+  // lhs: ident_t, rhs: extra index of the block and argc, followed by the
+  // name and type of every argument
+  NODE_FUNC,
+} node_kind_t;
+
+// Struct of arrays, a node is the same index in kind, op, lhs and rhs
+typedef struct _ast {
+  node_kind_t *kind;
+  uint8_t *op;
+  uint32_t *lhs;
+  uint32_t *rhs;
+  size_t len;
+  size_t cap;
+
+  VEC(uint32_t) extra;
+  VEC(node_t) funcs; // Every NODE_FUNC in source order
+} ast_t;
+
+typedef struct _ast_mark {
+  size_t len;
+  size_t extra_len;
+  size_t funcs_len;
+} ast_mark_t;
+
+void ast_init(ast_t *ast);
+void ast_free(ast_t *ast);
+void ast_reset(ast_t *ast);
+ast_mark_t ast_mark(const ast_t *ast);
+void ast_rollback(ast_t *ast, ast_mark_t mark);
+node_t ast_add(ast_t *ast, node_kind_t kind, uint8_t op, uint32_t lhs,
+               uint32_t rhs);
+node_t ast_add_num(ast_t *ast, int64_t value);
+// Appends count values to extra and returns the index of the first
+uint32_t ast_add_extra(ast_t *ast, const uint32_t *values, size_t count);
+
+static inline bool ast_is_arith(const ast_t *ast, node_t node) {
+  return ast->kind[node] <= NODE_PAREN;
+}
+
+static inline int64_t ast_num(const ast_t *ast, node_t node) {
+  return (int64_t)((uint64_t)ast->lhs[node] | (uint64_t)ast->rhs[node] << 32);
+}
+
+static inline uint32_t ast_call_argc(const ast_t *ast, node_t call) {
+  return ast->extra.data[ast->rhs[call]];
+}
+
+static inline node_t ast_call_arg(const ast_t *ast, node_t call, uint32_t i) {
+  return ast->extra.data[ast->rhs[call] + 1 + i];
+}
+
+static inline node_t ast_block_stmt(const ast_t *ast, node_t block,
+                                    uint32_t i) {
+  return ast->extra.data[ast->lhs[block] + i];
+}
+
+// The first node added for node's subtree, the subtree is every node from it
+// up to node
+static inline node_t ast_first(const ast_t *ast, node_t node) {
+  for (;;) {
+    switch (ast->kind[node]) {
+    case NODE_ARITH:
+    case NODE_PAREN:
+    case NODE_CMP:
+    case NODE_BOOL:
+    case NODE_GROUP:
+    case NODE_RET:
+    case NODE_IF:
+    case NODE_WHILE:
+      node = ast->lhs[node];
+      break;
+    case NODE_DECLARE:
+    case NODE_ASSIGN:
+      node = ast->rhs[node];
+      break;
+    case NODE_CALL:
+      if (ast_call_argc(ast, node) == 0)
+        return node;
+      node = ast_call_arg(ast, node, 0);
+      break;
+    case NODE_BLOCK:
+      if (ast->rhs[node] == 0)
+        return node;
+      node = ast_block_stmt(ast, node, 0);
+      break;
+    default:
+      return node;
+    }
+  }
+}
+
+static inline node_t ast_func_block(const ast_t *ast, node_t func) {
+  return ast->extra.data[ast->rhs[func]];
+}
+
+static inline uint32_t ast_func_argc(const ast_t *ast, node_t func) {
+  return ast->extra.data[ast->rhs[func] + 1];
+}
+
+static inline ident_t ast_func_arg_name(const ast_t *ast, node_t func,
+                                        uint32_t i) {
+  return ast->extra.data[ast->rhs[func] + 2 + i * 2];
+}
+
+static inline type_t ast_func_arg_type(const ast_t *ast, node_t func,
+                                       uint32_t i) {
+  return (type_t)ast->extra.data[ast->rhs[func] + 3 + i * 2];
+}
+
+#endif // _AST_H
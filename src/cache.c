@@ -0,0 +1,270 @@
+#include "cache.h"
+#include "intern.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout, every section starts 8 byte aligned:
+//   header
+//   idents * uint32_t length, then the identifiers, each NUL terminated
+//   per AST: chunk header, lhs, rhs, extra, funcs, kind, op
+// Identifiers are interned again on load, node fields holding an ident_t are
+// only rewritten if they come out with different IDs than when saved.
+
+#define CACHE_MAGIC "DUMAST\0"
+
+typedef struct _cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t asts;
+  uint64_t hash;
+  uint64_t src_len;
+  uint32_t idents;
+  uint32_t ident_bytes; // Including the NULs
+} cache_header_t;
+
+typedef struct _cache_chunk {
+  uint64_t len;
+  uint64_t extra_len;
+  uint64_t funcs_len;
+} cache_chunk_t;
+
+#define ALIGN8(X) (((X) + 7) & ~(size_t)7)
+
+uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Eight bytes a step, sources can be large and this runs on every compile
+uint64_t ast_cache_hash(const char *src, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, src + i, sizeof(v));
+    h = (h ^ mix64(v)) * 0x9e3779b97f4a7c15ULL;
+    h = (h << 31) | (h >> 33);
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, src + i, len - i);
+  h ^= mix64(tail ^ (len - i));
+  return mix64(h);
+}
+
+char *ast_cache_path(const char *dir, uint64_t hash) {
+  size_t len = strlen(dir) + 1 + 16 + sizeof(".ast");
+  char *path = malloc(len);
+  if (path == NULL)
+    err(EXIT_FAILURE, "failed to allocate cache path");
+  snprintf(path, len, "%s/%016llx.ast", dir, (unsigned long long)hash);
+  return path;
+}
+
+// Hands out consecutive sections of the mapping, NULL once it runs out
+typedef struct _cursor {
+  char *cur;
+  char *end;
+} cursor_t;
+
+void *take(cursor_t *c, size_t size) {
+  if ((size_t)(c->end - c->cur) < ALIGN8(size))
+    return NULL;
+  void *p = c->cur;
+  c->cur += ALIGN8(size);
+  return p;
+}
+
+void remap_idents(ast_t *ast, const ident_t *ids) {
+  for (node_t n = 0; n < ast->len; ++n) {
+    switch (ast->kind[n]) {
+    case NODE_IDENT:
+    case NODE_CALL:
+    case NODE_DECLARE:
+    case NODE_ASSIGN:
+      ast->lhs[n] = ids[ast->lhs[n]];
+      break;
+    case NODE_FUNC:
+      ast->lhs[n] = ids[ast->lhs[n]];
+      for (uint32_t i = 0; i < ast_func_argc(ast, n); ++i) {
+        uint32_t *name = &ast->extra.data[ast->rhs[n] + 2 + i * 2];
+        *name = ids[*name];
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool ast_cache_load(const char *path, uint64_t hash, size_t src_len,
+                    ast_cache_t *cache) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(cache_header_t)) {
+    close(fd);
+    return false;
+  }
+
+  // Private so a remap of identifiers can write to it without touching the
+  // file, the pages it doesn't touch stay shared with the page cache
+  size_t map_len = (size_t)st.st_size;
+  void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  cursor_t c = {.cur = map, .end = (char *)map + map_len};
+  cache_header_t *header = take(&c, sizeof(cache_header_t));
+  if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != AST_CACHE_VERSION || header->hash != hash ||
+      header->src_len != src_len)
+    goto fail;
+
+  uint32_t *ident_lens = take(&c, header->idents * sizeof(uint32_t));
+  const char *ident_strs = take(&c, header->ident_bytes);
+  if (ident_lens == NULL || ident_strs == NULL)
+    goto fail;
+
+  // In a fresh process these come out as 0, 1, 2... and nothing needs fixing
+  ident_t *ids = malloc(header->idents * sizeof(ident_t) + 1);
+  bool same_ids = true;
+  size_t off = 0;
+  for (uint32_t i = 0; i < header->idents; ++i) {
+    if (off + ident_lens[i] >= header->ident_bytes) {
+      free(ids);
+      goto fail;
+    }
+    ids[i] = intern(ident_strs + off, ident_lens[i]);
+    same_ids &= ids[i] == i;
+    off += ident_lens[i] + 1;
+  }
+
+  ast_t *asts = calloc(header->asts, sizeof(ast_t));
+  for (uint32_t i = 0; i < header->asts; ++i) {
+    cache_chunk_t *chunk = take(&c, sizeof(cache_chunk_t));
+    if (chunk == NULL)
+      goto fail_asts;
+    ast_t *ast = &asts[i];
+    ast->len = ast->cap = chunk->len;
+    ast->lhs = take(&c, chunk->len * sizeof(uint32_t));
+    ast->rhs = take(&c, chunk->len * sizeof(uint32_t));
+    ast->extra.data = take(&c, chunk->extra_len * sizeof(uint32_t));
+    ast->extra.len = ast->extra.cap = chunk->extra_len;
+    ast->funcs.data = take(&c, chunk->funcs_len * sizeof(node_t));
+    ast->funcs.len = ast->funcs.cap = chunk->funcs_len;
+    ast->kind = take(&c, chunk->len * sizeof(*ast->kind));
+    ast->op = take(&c, chunk->len * sizeof(*ast->op));
+    if (ast->lhs == NULL || ast->rhs == NULL || ast->extra.data == NULL ||
+        ast->funcs.data == NULL || ast->kind == NULL || ast->op == NULL)
+      goto fail_asts;
+    if (!same_ids)
+      remap_idents(ast, ids);
+  }
+  free(ids);
+
+  *cache = (ast_cache_t){
+      .map = map, .map_len = map_len, .asts = asts, .asts_len = header->asts};
+  return true;
+
+fail_asts:
+  free(asts);
+  free(ids);
+fail:
+  munmap(map, map_len);
+  return false;
+}
+
+void ast_cache_close(ast_cache_t *cache) {
+  free(cache->asts);
+  munmap(cache->map, cache->map_len);
+}
+
+bool write_padding(FILE *f, size_t written) {
+  static const char pad[8] = {0};
+  size_t padding = ALIGN8(written) - written;
+  return padding == 0 || fwrite(pad, padding, 1, f) == 1;
+}
+
+bool write_section(FILE *f, const void *data, size_t size) {
+  if (size != 0 && fwrite(data, size, 1, f) != 1)
+    return false;
+  return write_padding(f, size);
+}
+
+bool ast_cache_save(const char *path, uint64_t hash, size_t src_len,
+                    const ast_t **asts, size_t asts_len) {
+  // Written next to the final name and renamed over it, so a concurrent
+  // build never maps a half written file
+  size_t tmp_len = strlen(path) + 32;
+  char *tmp_path = malloc(tmp_len);
+  if (tmp_path == NULL)
+    return false;
+  snprintf(tmp_path, tmp_len, "%s.%ld.tmp", path, (long)getpid());
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    free(tmp_path);
+    return false;
+  }
+
+  size_t idents = ident_count();
+  uint32_t *lens = malloc(idents * sizeof(uint32_t) + 1);
+  size_t ident_bytes = 0;
+  for (size_t i = 0; i < idents; ++i) {
+    lens[i] = (uint32_t)ident_len((ident_t)i);
+    ident_bytes += lens[i] + 1;
+  }
+
+  cache_header_t header = {
+      .magic = CACHE_MAGIC,
+      .version = AST_CACHE_VERSION,
+      .asts = (uint32_t)asts_len,
+      .hash = hash,
+      .src_len = src_len,
+      .idents = (uint32_t)idents,
+      .ident_bytes = (uint32_t)ident_bytes,
+  };
+  bool ok = write_section(f, &header, sizeof(header)) &&
+            write_section(f, lens, idents * sizeof(uint32_t));
+  for (size_t i = 0; ok && i < idents; ++i)
+    ok = fwrite(ident_str((ident_t)i), lens[i] + 1, 1, f) == 1;
+  ok = ok && write_padding(f, ident_bytes);
+  free(lens);
+
+  for (size_t i = 0; ok && i < asts_len; ++i) {
+    const ast_t *ast = asts[i];
+    cache_chunk_t chunk = {
+        .len = ast->len,
+        .extra_len = ast->extra.len,
+        .funcs_len = ast->funcs.len,
+    };
+    ok = write_section(f, &chunk, sizeof(chunk)) &&
+         write_section(f, ast->lhs, ast->len * sizeof(uint32_t)) &&
+         write_section(f, ast->rhs, ast->len * sizeof(uint32_t)) &&
+         write_section(f, ast->extra.data, ast->extra.len * sizeof(uint32_t)) &&
+         write_section(f, ast->funcs.data, ast->funcs.len * sizeof(node_t)) &&
+         write_section(f, ast->kind, ast->len * sizeof(*ast->kind)) &&
+         write_section(f, ast->op, ast->len * sizeof(*ast->op));
+  }
+
+  ok = fclose(f) == 0 && ok;
+  if (ok)
+    ok = rename(tmp_path, path) == 0;
+  if (!ok)
+    unlink(tmp_path);
+  free(tmp_path);
+  return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "ast.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump whenever the layout of the file or the meaning of any node changes
+#define AST_CACHE_VERSION 3
+
+// ASTs loaded from a cache file, their arrays point into the mapping
+typedef struct _ast_cache {
+  void *map;
+  size_t map_len;
+  ast_t *asts;
+  size_t asts_len;
+} ast_cache_t;
+
+uint64_t ast_cache_hash(const char *src, size_t len);
+// dir/<hash>.ast, to be freed by the caller
+char *ast_cache_path(const char *dir, uint64_t hash);
+
+// False on a miss, or when the file is for another version or source
+bool ast_cache_load(const char *path, uint64_t hash, size_t src_len,
+                    ast_cache_t *cache);
+void ast_cache_close(ast_cache_t *cache);
+
+// Writes the ASTs of a source along with every interned identifier, so it
+// has to happen before anything unrelated to the source is interned
+bool ast_cache_save(const char *path, uint64_t hash, size_t src_len,
+                    const ast_t **asts, size_t asts_len);
+
+#endif // _CACHE_H
@@ -3,7 +3,9 @@
 #include "jmp.h"
 #include "obj.h"
 #include "parse.h"
+#include "regalloc.h"
 #include "scope.h"
+#include "vec.h"
 
 #include <err.h>
 #include <libelf.h>
@@ -13,29 +15,83 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define TEXT_SIZE 1024
-#define STRTAB_SIZE 256
-#define SYMTAB_SIZE 64
-
-Elf64_Sym symtab[SYMTAB_SIZE];
-size_t symtab_len;
-
-uint8_t text[TEXT_SIZE];
-size_t text_len;
-
-char strtab[STRTAB_SIZE];
-size_t strtab_len;
+// Grown as code is written and handed to write_obj() as they are. The text
+// length is also the write position, patching a jump moves it back and then
+// forward again over bytes that are already there.
+VEC(Elf64_Sym) symtab;
+VEC(uint8_t) text;
+VEC(char) strtab;
+// Where a function's prologue waits while its body is moved to make room
+VEC(uint8_t) prologue;
+
+// Indexed by ident_t, 0 means the function hasn't been written yet (the
+// first symbol is always the null symbol)
+size_t *func_syms;
+size_t func_syms_len;
+
+// Every call, patched by gen_end() once every function has its symbol
+typedef struct _call_fixup {
+  size_t loc; // Of the call instruction
+  ident_t name;
+} call_fixup_t;
+VEC(call_fixup_t) call_fixups;
+
+// Indexed by ident_t, 0 means the name isn't in strtab yet
+Elf64_Word *strtab_offsets;
+size_t strtab_offsets_len;
+
+// The tree being written, nodes below are indices into it
+const ast_t *gen_ast;
+
+// Leaf functions keep their locals in the red zone below RSP, without
+// setting up RBP
+bool omit_frame_pointer;
+#define RED_ZONE 128
+
+scope_t *func_scope;
+regalloc_t func_regs;
+// Index into func_regs.vars of the next variable codegen declares
+uint32_t next_var;
 
 // clang-format off
-bool regtab[NUM_REGISTERS] = {
+bool reserved_regs[NUM_REGISTERS] = {
     [RSP] = true, [RBP] = true, // Obviously
-    [RAX] = true, [RDX] = true, // For division :( TODO: find a better way to do this
     0
 };
 // clang-format on
+bool regtab[NUM_REGISTERS];
+
+// A value an expression holds on to while it works out the rest. When
+// registers run out, the held value needed last is spilled to its own slot
+// in the frame and loaded back the next time it's used.
+typedef struct _temp {
+  reg_t reg;   // NUM_REGISTERS while it's spilled
+  bool held;
+  bool pinned; // Needed by the instruction being written
+} temp_t;
+
+#define NO_TEMP UINT32_MAX
+
+// Temps are referred to by index, so spilling one can't leave its holder
+// with a stale register
+VEC(temp_t) temps;
+uint32_t reg_temps[NUM_REGISTERS]; // What each register holds, or NO_TEMP
+bool used_regs[NUM_REGISTERS]; // Written by the function, for the prologue
+reg_t frame_reg; // What frame positions are relative to, RBP or RSP
+int32_t spill_base;    // Frame position of temp 0's slot
+uint32_t spill_slots;  // Slots the function needs
+VEC(uint32_t) call_args; // Arguments worked out, waiting for their call
+
+// Registers each node of the expression being written needs, indexed from
+// need_first. Anything holding a call is worked out before what doesn't, so
+// fewer values are held across it.
+#define NEED_CALL (1u << 16)
+VEC(uint32_t) need;
+node_t need_first;
 
 reg_t prsrv_regs[5] = {RBX, R12, R13, R14, R15};
 reg_t param_regs[6] = {RDI, RSI, RDX, RCX, R8, R9};
+#define NUM_PARAM_REGS (sizeof(param_regs) / sizeof(reg_t))
 
 opcode_t cmptab[] = {
     [CMP_OP_EQU] = JE_REL32, [CMP_OP_NEQ] = JNE_REL32,
@@ -43,62 +99,75 @@ opcode_t cmptab[] = {
     [CMP_OP_GT] = JG_REL32,  [CMP_OP_LTE] = JLE_REL32,
 };
 
+// The same comparisons with their operands the other way around
+opcode_t cmptab_swapped[] = {
+    [CMP_OP_EQU] = JE_REL32, [CMP_OP_NEQ] = JNE_REL32,
+    [CMP_OP_LT] = JG_REL32,  [CMP_OP_GTE] = JLE_REL32,
+    [CMP_OP_GT] = JL_REL32,  [CMP_OP_LTE] = JGE_REL32,
+};
+
 /* Utils */
 
 void write_jmp(opcode_t opc, int32_t dest);
 
-void text_set_pos(size_t pos) { text_len = pos; }
-size_t text_get_pos() { return text_len; }
+void text_set_pos(size_t pos) { text.len = pos; }
+size_t text_get_pos() { return text.len; }
 
-void append_strtab(char *str) {
-  strcpy(strtab + strtab_len, str);
-  strtab_len += strlen(str) + 1;
-  strtab[strtab_len] = '\0';
+void append_strtab(const char *str) {
+  size_t len = strlen(str) + 1;
+  VEC_RESERVE(strtab, len);
+  memcpy(strtab.data + strtab.len, str, len);
+  strtab.len += len;
 }
 
-void print_strtab() {
-  for (size_t i = 0; i < strtab_len; ++i) {
-    if (strtab[i] == 0)
-      printf("(null)");
-    else
-      printf("%c", strtab[i]);
-  }
-  printf("\n");
-}
+// Grows a table indexed by ident_t so that ID fits, zeroing the new slots
+#define IDENT_TABLE_FIT(TABLE, LEN, ID)                                        \
+  do {                                                                         \
+    if ((ID) >= (LEN)) {                                                       \
+      size_t new_len = ident_count() > (ID) ? ident_count() : (ID) + 1;        \
+      (TABLE) = realloc((TABLE), new_len * sizeof(*(TABLE)));                  \
+      if ((TABLE) == NULL)                                                     \
+        errx(EXIT_FAILURE, "failed to grow " #TABLE);                          \
+      memset((TABLE) + (LEN), 0, (new_len - (LEN)) * sizeof(*(TABLE)));       \
+      (LEN) = new_len;                                                         \
+    }                                                                          \
+  } while (0)
 
-reg_t next_reg() {
-  for (int i = 0; i < NUM_REGISTERS; ++i) {
-    // this register is not in use
-    if (!regtab[i]) {
-      // now in use
-      regtab[i] = true;
-      return (reg_t)i;
-    }
+Elf64_Word strtab_offset(ident_t id) {
+  IDENT_TABLE_FIT(strtab_offsets, strtab_offsets_len, id);
+  if (strtab_offsets[id] == 0) {
+    strtab_offsets[id] = (Elf64_Word)strtab.len;
+    append_strtab(ident_str(id));
   }
+  return strtab_offsets[id];
+}
 
-  errx(EXIT_FAILURE, "not enough registers available!");
+const Elf64_Sym *get_func_sym(ident_t id) {
+  if (id >= func_syms_len || func_syms[id] == 0)
+    return NULL;
+  return &symtab.data[func_syms[id]];
 }
 
-void reset_regtab() {
-  memset(regtab, 0, sizeof(regtab));
-  regtab[RSP] = true;
-  regtab[RBP] = true;
-  regtab[RAX] = true;
-  regtab[RDX] = true;
+void print_strtab() {
+  for (size_t i = 0; i < strtab.len; ++i) {
+    if (strtab.data[i] == 0)
+      printf("(null)");
+    else
+      printf("%c", strtab.data[i]);
+  }
+  printf("\n");
 }
 
 void emit() {
   uint8_t *instr;
   uint8_t size = instr_flush(&instr);
 
-  if (text_len + size >= TEXT_SIZE)
-    errx(EXIT_FAILURE, "text section bigger than %d bytes", TEXT_SIZE);
-
   if (instr == NULL)
     errx(EXIT_FAILURE, "failed to write instruction");
 
-  memcpy(text + text_len, instr, size);
-  text_len += size;
+  VEC_RESERVE(text, size);
+  memcpy(text.data + text.len, instr, size);
+  text.len += size;
 }
 
 #define REXB(REG, FLAGS)                                                       \
@@ -150,43 +219,106 @@ void mov_reg_to_reg(reg_t dst, reg_t src) {
   emit();
 }
 
-void mov_imm64_to_reg(reg_t reg, int64_t imm) {
-  REXB(reg, REX_W);
-  instr_set_opcode_inc(MOV_R_IMM, reg_num(reg));
-  instr_set_imm64((uint64_t)imm);
+bool fits_imm8(int64_t imm) { return imm >= INT8_MIN && imm <= INT8_MAX; }
+bool fits_imm32(int64_t imm) { return imm >= INT32_MIN && imm <= INT32_MAX; }
+
+// The shortest mov for the value: writing the low half zeroes the high one,
+// negatives that fit are sign extended from 32 bits, the rest take all 64
+void mov_imm_to_reg(reg_t reg, int64_t imm) {
+  if (imm >= 0 && imm <= UINT32_MAX) {
+    REXB(reg, 0);
+    instr_set_opcode_inc(MOV_R_IMM, reg_num(reg));
+    instr_set_imm32((uint32_t)imm);
+  } else if (fits_imm32(imm)) {
+    REXB(reg, REX_W);
+    instr_set_opcode(MOV_RM_IMM);
+    instr_set_mod(MOD_REG);
+    instr_set_rm(reg);
+    instr_set_reg(0);
+    instr_set_imm32((uint32_t)imm);
+  } else {
+    REXB(reg, REX_W);
+    instr_set_opcode_inc(MOV_R_IMM, reg_num(reg));
+    instr_set_imm64((uint64_t)imm);
+  }
   emit();
 }
 
+// RSP and R12 can only be a base through a SIB byte, one without an index
+#define SIB_BASE(BASE)                                                         \
+  if (reg_num(BASE) == reg_num(RSP))                                           \
+    instr_set_sib(0x24);
+
+// One byte signed displacement when it fits, four otherwise
+void set_disp(int32_t displacement) {
+  if (fits_imm8(displacement)) {
+    instr_set_mod(MOD_DISP_1);
+    instr_set_disp8((uint8_t)displacement);
+  } else {
+    instr_set_mod(MOD_DISP_4);
+    instr_set_disp32((uint32_t)displacement);
+  }
+}
+
 void mov_mem_offset_to_reg(reg_t dst, reg_t src_base, int32_t displacement) {
   REXBR(dst, src_base, REX_W);
   instr_set_opcode(MOV_RM_R);
-  instr_set_mod(MOD_DISP_4); // Four byte signed displacement
+  set_disp(displacement);
   instr_set_rm(src_base);
+  SIB_BASE(src_base);
   instr_set_reg(dst);
-  instr_set_disp32((uint32_t)displacement);
   emit();
 }
 
 void mov_reg_to_mem_offset(reg_t src, reg_t dst_base, int32_t displacement) {
   REXBR(src, dst_base, REX_W);
   instr_set_opcode(MOV_R_RM);
-  instr_set_mod(MOD_DISP_4); // Four byte signed displacement
+  set_disp(displacement);
   instr_set_rm(dst_base);
+  SIB_BASE(dst_base);
   instr_set_reg(src);
-  instr_set_disp32((uint32_t)displacement);
   emit();
 }
 
-void sub_imm32(reg_t reg, int32_t imm) {
+// add, sub, and and cmp with an immediate share their encodings, the ModRM
+// reg field picks which. Each has a sign extended imm8 form, a general imm32
+// one, and an imm32 one for RAX without the ModRM byte.
+typedef struct _imm_op {
+  uint8_t ext;
+  opcode_t imm8;
+  opcode_t imm32;
+  opcode_t rax;
+} imm_op_t;
+
+const imm_op_t IMM_ADD = {0, ADD_RM_IMM8, ADD_RM_IMM, ADD_EAX_IMM};
+const imm_op_t IMM_AND = {4, AND_RM_IMM8, AND_RM_IMM, AND_EAX_IMM};
+const imm_op_t IMM_SUB = {5, SUB_RM_IMM8, SUB_RM_IMM, SUB_EAX_IMM};
+const imm_op_t IMM_CMP = {7, CMP_RM_IMM8, CMP_RM_IMM, CMP_EAX_IMM};
+
+void op_reg_imm(imm_op_t op, reg_t reg, int32_t imm) {
   REXB(reg, REX_W);
-  instr_set_opcode(SUB_RM_IMM);
+  if (fits_imm8(imm)) {
+    instr_set_opcode(op.imm8);
+    instr_set_imm8((uint8_t)imm);
+  } else if (reg == RAX) {
+    instr_set_opcode(op.rax);
+    instr_set_imm32((uint32_t)imm);
+    emit();
+    return;
+  } else {
+    instr_set_opcode(op.imm32);
+    instr_set_imm32((uint32_t)imm);
+  }
   instr_set_mod(MOD_REG);
   instr_set_rm(reg);
-  instr_set_reg(0b101);
-  instr_set_imm32((uint32_t)imm);
+  instr_set_reg(op.ext);
   emit();
 }
 
+void add_imm(reg_t reg, int32_t imm) { op_reg_imm(IMM_ADD, reg, imm); }
+void sub_imm(reg_t reg, int32_t imm) { op_reg_imm(IMM_SUB, reg, imm); }
+void cmp_imm(reg_t reg, int32_t imm) { op_reg_imm(IMM_CMP, reg, imm); }
+
 void sub_reg_to_reg(reg_t dst, reg_t src) {
   REXBR(dst, src, REX_W);
   instr_set_opcode(SUB_R_RM);
@@ -214,12 +346,102 @@ void imul_reg_to_reg(reg_t dst, reg_t src) {
   emit();
 }
 
-void div_reg_to_reg(reg_t quotient) {
-  REXB(quotient, REX_W);
-  instr_set_opcode(DIV_RM);
+// dst = src * imm
+void imul_imm(reg_t dst, reg_t src, int32_t imm) {
+  REXBR(dst, src, REX_W);
+  if (fits_imm8(imm)) {
+    instr_set_opcode(IMUL_R_RM_IMM8);
+    instr_set_imm8((uint8_t)imm);
+  } else {
+    instr_set_opcode(IMUL_R_RM_IMM);
+    instr_set_imm32((uint32_t)imm);
+  }
+  instr_set_mod(MOD_REG);
+  instr_set_rm(src);
+  instr_set_reg(dst);
+  emit();
+}
+
+// RAX = RDX:RAX / divisor, signed
+void idiv_reg(reg_t divisor) {
+  REXB(divisor, REX_W);
+  instr_set_opcode(IDIV_RM);
+  instr_set_mod(MOD_REG);
+  instr_set_rm(divisor);
+  instr_set_reg(7);
+  emit();
+}
+
+// RDX:RAX = RAX * src, signed
+void imul_reg(reg_t src) {
+  REXB(src, REX_W);
+  instr_set_opcode(IMUL_RM);
   instr_set_mod(MOD_REG);
-  instr_set_rm(quotient);
-  instr_set_reg(6);
+  instr_set_rm(src);
+  instr_set_reg(5);
+  emit();
+}
+
+void neg_reg(reg_t reg) {
+  REXB(reg, REX_W);
+  instr_set_opcode(NEG_RM);
+  instr_set_mod(MOD_REG);
+  instr_set_rm(reg);
+  instr_set_reg(3);
+  emit();
+}
+
+// Sign extends RAX into RDX
+void cqo() {
+  instr_set_rex(REX_W);
+  instr_set_opcode(CQO);
+  emit();
+}
+
+void shift_reg_imm8(opcode_t opc, uint8_t ext, reg_t reg, uint8_t imm) {
+  REXB(reg, REX_W);
+  instr_set_opcode(opc);
+  instr_set_mod(MOD_REG);
+  instr_set_rm(reg);
+  instr_set_reg(ext);
+  instr_set_imm8(imm);
+  emit();
+}
+
+void shl_reg_imm8(reg_t reg, uint8_t imm) {
+  shift_reg_imm8(SHL_RM_IMM8, 4, reg, imm);
+}
+
+void shr_reg_imm8(reg_t reg, uint8_t imm) {
+  shift_reg_imm8(SHR_RM_IMM8, 5, reg, imm);
+}
+
+void sar_reg_imm8(reg_t reg, uint8_t imm) {
+  shift_reg_imm8(SAR_RM_IMM8, 7, reg, imm);
+}
+
+// dst = base + index * scale, scale being 2, 4 or 8
+void lea_scaled(reg_t dst, reg_t base, reg_t index, uint8_t scale) {
+  rex_flags_t flags = REX_W;
+  if (dst >= R8)
+    flags |= REX_R;
+  if (index >= R8)
+    flags |= REX_X;
+  if (base >= R8)
+    flags |= REX_B;
+  instr_set_rex(flags);
+  instr_set_opcode(LEA_R_M);
+  // RBP and R13 as a base always come with a displacement
+  if (reg_num(base) == reg_num(RBP)) {
+    instr_set_mod(MOD_DISP_1);
+    instr_set_disp8(0);
+  } else {
+    instr_set_mod(MOD_INDIRECT);
+  }
+  instr_set_reg(dst);
+  instr_set_rm(0b100); // A SIB byte follows
+  uint8_t ss = scale == 8 ? 3 : scale == 4 ? 2 : 1;
+  instr_set_sib((uint8_t)(ss << 6 | reg_num(index) << 3 | reg_num(base)));
   emit();
 }
 
@@ -234,22 +456,18 @@ void call_rel32(int32_t disp) {
   emit();
 }
 
+// Subtract the function's position by the call's position, then subtract the
+// size of call() instr (5) since its relative to the next instr
+int32_t call_disp(const Elf64_Sym *sym, size_t loc) {
+  return (int32_t)(sym->st_value - loc) - 5;
+}
+
 void write_jmp(opcode_t opc, int32_t dest) {
   instr_set_opcode(opc);
   instr_set_disp32((uint32_t)dest);
   emit();
 }
 
-void cmp_reg_imm8(reg_t reg, uint8_t imm) {
-  REXB(reg, REX_W);
-  instr_set_opcode(CMP_RM_IMM8);
-  instr_set_mod(MOD_REG);
-  instr_set_reg(7);
-  instr_set_rm(reg);
-  instr_set_imm8(imm);
-  emit();
-}
-
 void cmp_reg_to_reg(reg_t lhs, reg_t rhs) {
   REXBR(rhs, lhs, REX_W);
   instr_set_opcode(CMP_R_RM);
@@ -261,39 +479,500 @@ void cmp_reg_to_reg(reg_t lhs, reg_t rhs) {
 
 /* Write Machine Instructions */
 
-void write_codeblock(code_block_t *block, scope_t *scope,
-                     jmptab_t *superjmptab);
-void evaluate_expression_to_arith(expression_t *expr, reg_t result,
-                                  scope_t *scope);
-void evaluate_arith_expression(arith_expression_t *expr, reg_t result,
-                               scope_t *scope);
-
-reg_t _evaluate_arith_expression(arith_expression_t *expr, scope_t *scope) {
-  // Arith expr parsing might not populate all nodes in the tree
-  // because I'm bad at programming
-  // Lets check before we do anything and leave a nice error message
-  if (expr == NULL) {
-    errx(EXIT_FAILURE, "NULL node found in arith tree");
-  }
-  if (expr->type == ARITH_NUM) {
-    reg_t r = next_reg();
-    mov_imm64_to_reg(r, expr->instance.int64);
-    return r;
-  } else if (expr->type == ARITH_IDENT) {
-    const scope_var_t *scope_var = scope_get(scope, expr->instance.name);
+int32_t spill_pos(uint32_t temp) { return spill_base - (int32_t)temp * 8; }
+
+void spill_temp(uint32_t temp) {
+  reg_t reg = temps.data[temp].reg;
+  mov_reg_to_mem_offset(reg, frame_reg, spill_pos(temp));
+  reg_temps[reg] = NO_TEMP;
+  temps.data[temp].reg = NUM_REGISTERS;
+  if (temp + 1 > spill_slots)
+    spill_slots = temp + 1;
+}
+
+reg_t next_reg() {
+  for (int i = 0; i < NUM_REGISTERS; ++i) {
+    // this register is not in use
+    if (!regtab[i]) {
+      // now in use
+      regtab[i] = true;
+      used_regs[i] = true;
+      return (reg_t)i;
+    }
+  }
+
+  // Expressions are worked out depth first, so the value held the longest
+  // is the one needed last
+  for (uint32_t i = 0; i < temps.len; ++i) {
+    temp_t *temp = &temps.data[i];
+    if (temp->held && !temp->pinned && temp->reg != NUM_REGISTERS) {
+      reg_t reg = temp->reg;
+      spill_temp(i);
+      return reg;
+    }
+  }
+
+  errx(EXIT_FAILURE, "not enough registers available!");
+}
+
+uint32_t new_temp() {
+  uint32_t temp = (uint32_t)temps.len;
+  VEC_PUSH(temps, ((temp_t){.reg = NUM_REGISTERS, .held = true}));
+  reg_t reg = next_reg();
+  temps.data[temp].reg = reg;
+  reg_temps[reg] = temp;
+  return temp;
+}
+
+// Loads the temp back if it was spilled
+reg_t temp_reg(uint32_t temp) {
+  if (temps.data[temp].reg == NUM_REGISTERS) {
+    reg_t reg = next_reg();
+    mov_mem_offset_to_reg(reg, frame_reg, spill_pos(temp));
+    temps.data[temp].reg = reg;
+    reg_temps[reg] = temp;
+  }
+  return temps.data[temp].reg;
+}
+
+// Both in registers at once, loading the second can't spill the first
+void temp_regs(uint32_t lhs, uint32_t rhs, reg_t *lhsr, reg_t *rhsr) {
+  *rhsr = temp_reg(rhs);
+  temps.data[rhs].pinned = true;
+  *lhsr = temp_reg(lhs);
+  temps.data[rhs].pinned = false;
+}
+
+void free_temp(uint32_t temp) {
+  reg_t reg = temps.data[temp].reg;
+  if (reg != NUM_REGISTERS) {
+    regtab[reg] = false;
+    reg_temps[reg] = NO_TEMP;
+  }
+  temps.data[temp].held = false;
+  while (temps.len > 0 && !temps.data[temps.len - 1].held)
+    temps.len--;
+}
+
+// Takes reg for an instruction that needs it, whatever temp it held is moved
+// to a free register, or to its slot when there isn't one
+void take_reg(reg_t reg) {
+  regtab[reg] = true;
+  uint32_t temp = reg_temps[reg];
+  if (temp == NO_TEMP)
+    return;
+  for (int i = 0; i < NUM_REGISTERS; ++i) {
+    if (!regtab[i]) {
+      regtab[i] = true;
+      used_regs[i] = true;
+      mov_reg_to_reg((reg_t)i, reg);
+      temps.data[temp].reg = (reg_t)i;
+      reg_temps[i] = temp;
+      reg_temps[reg] = NO_TEMP;
+      return;
+    }
+  }
+  spill_temp(temp);
+}
+
+bool is_preserved(reg_t reg) {
+  for (unsigned int i = 0; i < sizeof(prsrv_regs) / sizeof(reg_t); ++i) {
+    if (prsrv_regs[i] == reg)
+      return true;
+  }
+  return false;
+}
+
+// A call only keeps the preserved registers. Temps held from before it that
+// are anywhere else go to a free preserved register, or to their slots.
+void save_temps(uint32_t below) {
+  for (uint32_t i = 0; i < below; ++i) {
+    temp_t *temp = &temps.data[i];
+    reg_t reg = temp->reg;
+    if (!temp->held || reg == NUM_REGISTERS || is_preserved(reg))
+      continue;
+
+    reg_t safe = NUM_REGISTERS;
+    for (unsigned int p = 0; p < sizeof(prsrv_regs) / sizeof(reg_t); ++p) {
+      if (!regtab[prsrv_regs[p]]) {
+        safe = prsrv_regs[p];
+        break;
+      }
+    }
+    if (safe == NUM_REGISTERS) {
+      spill_temp(i);
+    } else {
+      regtab[safe] = true;
+      used_regs[safe] = true;
+      mov_reg_to_reg(safe, reg);
+      temp->reg = safe;
+      reg_temps[safe] = i;
+      reg_temps[reg] = NO_TEMP;
+    }
+    regtab[reg] = false;
+  }
+}
+
+// Puts the temp's value in reg, which must be free or its own, and lets go
+// of the temp
+void move_temp(uint32_t temp, reg_t reg) {
+  if (temps.data[temp].reg == NUM_REGISTERS)
+    mov_mem_offset_to_reg(reg, frame_reg, spill_pos(temp));
+  else
+    mov_reg_to_reg(reg, temps.data[temp].reg);
+  free_temp(temp);
+}
+
+// Labels every node of expr with the registers it needs, children come
+// before their parents so one pass in node order does it
+void label_need(node_t expr) {
+  const ast_t *ast = gen_ast;
+  need_first = ast_first(ast, expr);
+  need.len = 0;
+  VEC_RESERVE(need, expr - need_first + 1);
+  for (node_t node = need_first; node <= expr; ++node) {
+    uint32_t n = 0;
+    switch (ast->kind[node]) {
+    case NODE_NUM:
+    case NODE_IDENT:
+      n = 1;
+      break;
+    case NODE_CALL:
+      n = NEED_CALL;
+      break;
+    case NODE_PAREN:
+      n = need.data[ast->lhs[node] - need_first];
+      break;
+    case NODE_ARITH:
+    case NODE_CMP: {
+      uint32_t lhs = need.data[ast->lhs[node] - need_first];
+      uint32_t rhs = need.data[ast->rhs[node] - need_first];
+      n = lhs == rhs ? lhs + 1 : lhs > rhs ? lhs : rhs;
+      break;
+    }
+    default:
+      break;
+    }
+    need.data[need.len++] = n;
+  }
+}
+
+// The operand needing more registers goes first, its result then only holds
+// one while the other is worked out. Two calls stay in source order.
+bool rhs_first(node_t lhs, node_t rhs) {
+  uint32_t lhs_need = need.data[lhs - need_first];
+  uint32_t rhs_need = need.data[rhs - need_first];
+  if (lhs_need >= NEED_CALL && rhs_need >= NEED_CALL)
+    return false;
+  return rhs_need > lhs_need;
+}
+
+// Leaves expressions the registers no variable is using anywhere in expr
+void reset_regtab(node_t expr) {
+  memcpy(regtab, reserved_regs, sizeof(regtab));
+  for (int i = 0; i < NUM_REGISTERS; ++i)
+    reg_temps[i] = NO_TEMP;
+  temps.len = 0;
+  regalloc_live(&func_regs, ast_first(gen_ast, expr), expr, regtab);
+  label_need(expr);
+}
+
+void load_var(reg_t dst, const scope_var_t *var) {
+  if (var->reg != NUM_REGISTERS)
+    mov_reg_to_reg(dst, var->reg);
+  else
+    mov_mem_offset_to_reg(dst, frame_reg, var->position);
+}
+
+void store_var(const scope_var_t *var, reg_t src) {
+  if (var->reg != NUM_REGISTERS)
+    mov_reg_to_reg(var->reg, src);
+  else
+    mov_reg_to_mem_offset(src, frame_reg, var->position);
+}
+
+void write_codeblock(node_t block, scope_t *scope, jmptab_t *superjmptab);
+void evaluate_expression_to_arith(node_t expr, reg_t result, scope_t *scope);
+void evaluate_arith_expression(node_t expr, reg_t result, scope_t *scope);
+
+uint32_t _evaluate_arith_expression(node_t expr, scope_t *scope);
+
+// Works out both operands of a binary node, the needier one first
+void evaluate_operands(node_t expr, uint32_t *lhs, uint32_t *rhs,
+                       scope_t *scope) {
+  if (rhs_first(gen_ast->lhs[expr], gen_ast->rhs[expr])) {
+    *rhs = _evaluate_arith_expression(gen_ast->rhs[expr], scope);
+    *lhs = _evaluate_arith_expression(gen_ast->lhs[expr], scope);
+  } else {
+    *lhs = _evaluate_arith_expression(gen_ast->lhs[expr], scope);
+    *rhs = _evaluate_arith_expression(gen_ast->rhs[expr], scope);
+  }
+}
+
+// The temp's value was put in reg, which it now owns
+void set_temp_reg(uint32_t temp, reg_t reg) {
+  reg_t old = temps.data[temp].reg;
+  if (old != NUM_REGISTERS && old != reg) {
+    regtab[old] = false;
+    reg_temps[old] = NO_TEMP;
+  }
+  temps.data[temp].reg = reg;
+  reg_temps[reg] = temp;
+}
+
+// Only division needs RAX and RDX, they're taken from whatever temps hold them
+// just for it. The quotient is left in RAX as lhs.
+void write_div(uint32_t lhs, uint32_t rhs) {
+  temps.data[lhs].pinned = true;
+  if (reg_temps[RAX] != lhs)
+    take_reg(RAX);
+  take_reg(RDX);
+  reg_t rhsr = temp_reg(rhs);
+  temps.data[lhs].pinned = false;
+
+  reg_t lhsr = temps.data[lhs].reg;
+  if (lhsr == NUM_REGISTERS)
+    mov_mem_offset_to_reg(RAX, frame_reg, spill_pos(lhs));
+  else
+    mov_reg_to_reg(RAX, lhsr);
+  set_temp_reg(lhs, RAX);
+
+  cqo();
+  idiv_reg(rhsr);
+  regtab[RDX] = false;
+  free_temp(rhs);
+}
+
+// Shift and multiplier of the signed division by d, for 2 < |d| that isn't
+// a power of two. The quotient is the high half of x * magic, corrected and
+// shifted right. Hacker's Delight, 10-4.
+void div_magic(int64_t d, int64_t *magic, uint8_t *shift) {
+  const uint64_t two63 = 1ull << 63;
+  uint64_t ad = d < 0 ? -(uint64_t)d : (uint64_t)d;
+  uint64_t t = two63 + ((uint64_t)d >> 63);
+  uint64_t anc = t - 1 - t % ad;
+  uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+  uint64_t delta;
+  unsigned int p = 63;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  *magic = (int64_t)(q2 + 1);
+  if (d < 0)
+    *magic = -*magic;
+  *shift = (uint8_t)(p - 64);
+}
+
+// Divides the temp by a constant that isn't 0 without idiv, rounding toward
+// zero like it does
+void write_div_const(uint32_t temp, int64_t d) {
+  uint64_t ad = d < 0 ? -(uint64_t)d : (uint64_t)d;
+  if (ad == 1) {
+    if (d < 0)
+      neg_reg(temp_reg(temp));
+    return;
+  }
+
+  if ((ad & (ad - 1)) == 0) {
+    // Negative values are biased by 2^k - 1 first, so shifting rounds up
+    uint8_t k = (uint8_t)__builtin_ctzll(ad);
+    uint32_t bias = new_temp();
+    reg_t reg, biasr;
+    temp_regs(temp, bias, &reg, &biasr);
+    mov_reg_to_reg(biasr, reg);
+    if (k > 1)
+      sar_reg_imm8(biasr, 63);
+    shr_reg_imm8(biasr, (uint8_t)(64 - k));
+    add_reg_to_reg(reg, biasr);
+    sar_reg_imm8(reg, k);
+    free_temp(bias);
+    if (d < 0)
+      neg_reg(reg);
+    return;
+  }
+
+  int64_t magic;
+  uint8_t shift;
+  div_magic(d, &magic, &shift);
+
+  temps.data[temp].pinned = true;
+  take_reg(RAX);
+  take_reg(RDX);
+  reg_t reg = temp_reg(temp);
+  temps.data[temp].pinned = false;
+
+  mov_imm_to_reg(RAX, magic);
+  imul_reg(reg);
+  if (d > 0 && magic < 0)
+    add_reg_to_reg(RDX, reg);
+  else if (d < 0 && magic > 0)
+    sub_reg_to_reg(RDX, reg);
+  if (shift != 0)
+    sar_reg_imm8(RDX, shift);
+  // Add one when it's negative, rounding toward zero
+  mov_reg_to_reg(RAX, RDX);
+  shr_reg_imm8(RAX, 63);
+  add_reg_to_reg(RDX, RAX);
+  regtab[RAX] = false;
+  set_temp_reg(temp, RDX);
+}
+
+// Multiplies the temp by a constant with shifts, lea and adds when the
+// constant is some 2^k times 1, 3, 5, 9 or 2^j +- 1, with imul otherwise
+void write_mul_const(uint32_t temp, int64_t c) {
+  uint64_t ac = c < 0 ? -(uint64_t)c : (uint64_t)c;
+  if (ac == 0) {
+    // The temp was still worked out for any call in it
+    mov_imm_to_reg(temp_reg(temp), 0);
+    return;
+  }
+  uint8_t k = (uint8_t)__builtin_ctzll(ac);
+  uint64_t odd = ac >> k;
+
+  reg_t reg;
+  if (odd == 1) {
+    reg = temp_reg(temp);
+  } else if (odd == 3 || odd == 5 || odd == 9) {
+    reg = temp_reg(temp);
+    lea_scaled(reg, reg, reg, (uint8_t)(odd - 1));
+  } else if (((odd - 1) & (odd - 2)) == 0 || ((odd + 1) & odd) == 0) {
+    // odd is 2^j + 1 or 2^j - 1
+    bool plus = ((odd - 1) & (odd - 2)) == 0;
+    uint8_t j = (uint8_t)__builtin_ctzll(plus ? odd - 1 : odd + 1);
+    uint32_t copy = new_temp();
+    reg_t copyr;
+    temp_regs(temp, copy, &reg, &copyr);
+    mov_reg_to_reg(copyr, reg);
+    shl_reg_imm8(reg, j);
+    if (plus)
+      add_reg_to_reg(reg, copyr);
+    else
+      sub_reg_to_reg(reg, copyr);
+    free_temp(copy);
+  } else if (fits_imm32(c)) {
+    reg = temp_reg(temp);
+    imul_imm(reg, reg, (int32_t)c);
+    return;
+  } else {
+    uint32_t factor = new_temp();
+    reg_t factorr;
+    mov_imm_to_reg(temps.data[factor].reg, c);
+    temp_regs(temp, factor, &reg, &factorr);
+    imul_reg_to_reg(reg, factorr);
+    free_temp(factor);
+    return;
+  }
+  if (k != 0)
+    shl_reg_imm8(reg, k);
+  if (c < 0)
+    neg_reg(reg);
+}
+
+// A number that fits an instruction's sign extended imm32
+bool is_imm(node_t node) {
+  return gen_ast->kind[node] == NODE_NUM && fits_imm32(ast_num(gen_ast, node));
+}
+
+// Returns the temp holding the value
+uint32_t _evaluate_arith_expression(node_t expr, scope_t *scope) {
+  const ast_t *ast = gen_ast;
+  switch (ast->kind[expr]) {
+  case NODE_NUM: {
+    uint32_t temp = new_temp();
+    mov_imm_to_reg(temps.data[temp].reg, ast_num(ast, expr));
+    return temp;
+  }
+  case NODE_IDENT: {
+    ident_t name = ast->lhs[expr];
+    const scope_var_t *scope_var = scope_get(scope, name);
     if (scope_var == NULL)
-      errx(EXIT_FAILURE, "error: '%s' not found in scope", expr->instance.name);
-    reg_t r = next_reg();
-    mov_mem_offset_to_reg(r, RBP, scope_var->position);
-    return r;
-  } else if (expr->type == ARITH_OP) {
-    const arith_operation_t *op = expr->instance.op;
-    reg_t lhsr = _evaluate_arith_expression(op->lhs, scope);
-    reg_t rhsr = _evaluate_arith_expression(op->rhs, scope);
-
-    regtab[rhsr] = false;
-
-    switch (op->op) {
+      errx(EXIT_FAILURE, "error: '%s' not found in scope", ident_str(name));
+    uint32_t temp = new_temp();
+    load_var(temps.data[temp].reg, scope_var);
+    return temp;
+  }
+  case NODE_ARITH: {
+    node_t lhs_node = ast->lhs[expr];
+    node_t rhs_node = ast->rhs[expr];
+    // Constant factors and divisors are never loaded, the instructions for
+    // them are picked by their value. Constants added or subtracted are
+    // immediates when they fit.
+    switch ((arith_operator_t)ast->op[expr]) {
+    case ARITH_OP_ADD:
+      if (is_imm(rhs_node)) {
+        uint32_t temp = _evaluate_arith_expression(lhs_node, scope);
+        add_imm(temp_reg(temp), (int32_t)ast_num(ast, rhs_node));
+        return temp;
+      }
+      if (is_imm(lhs_node)) {
+        uint32_t temp = _evaluate_arith_expression(rhs_node, scope);
+        add_imm(temp_reg(temp), (int32_t)ast_num(ast, lhs_node));
+        return temp;
+      }
+      break;
+    case ARITH_OP_SUB:
+      if (is_imm(rhs_node)) {
+        uint32_t temp = _evaluate_arith_expression(lhs_node, scope);
+        sub_imm(temp_reg(temp), (int32_t)ast_num(ast, rhs_node));
+        return temp;
+      }
+      if (is_imm(lhs_node)) {
+        // c - x is -x + c
+        uint32_t temp = _evaluate_arith_expression(rhs_node, scope);
+        reg_t reg = temp_reg(temp);
+        neg_reg(reg);
+        if (ast_num(ast, lhs_node) != 0)
+          add_imm(reg, (int32_t)ast_num(ast, lhs_node));
+        return temp;
+      }
+      break;
+    case ARITH_OP_MUL:
+      if (ast->kind[rhs_node] == NODE_NUM) {
+        uint32_t temp = _evaluate_arith_expression(lhs_node, scope);
+        write_mul_const(temp, ast_num(ast, rhs_node));
+        return temp;
+      }
+      if (ast->kind[lhs_node] == NODE_NUM) {
+        uint32_t temp = _evaluate_arith_expression(rhs_node, scope);
+        write_mul_const(temp, ast_num(ast, lhs_node));
+        return temp;
+      }
+      break;
+    case ARITH_OP_DIV:
+      if (ast->kind[rhs_node] == NODE_NUM && ast_num(ast, rhs_node) != 0) {
+        uint32_t temp = _evaluate_arith_expression(lhs_node, scope);
+        write_div_const(temp, ast_num(ast, rhs_node));
+        return temp;
+      }
+      break;
+    default:
+      break;
+    }
+
+    uint32_t lhs, rhs;
+    evaluate_operands(expr, &lhs, &rhs, scope);
+    if ((arith_operator_t)ast->op[expr] == ARITH_OP_DIV) {
+      write_div(lhs, rhs);
+      return lhs;
+    }
+    reg_t lhsr, rhsr;
+    temp_regs(lhs, rhs, &lhsr, &rhsr);
+
+    switch ((arith_operator_t)ast->op[expr]) {
     case ARITH_OP_ADD:
       add_reg_to_reg(lhsr, rhsr);
       break;
@@ -303,177 +982,251 @@ reg_t _evaluate_arith_expression(arith_expression_t *expr, scope_t *scope) {
     case ARITH_OP_SUB:
       sub_reg_to_reg(lhsr, rhsr);
       break;
-    case ARITH_OP_DIV:
-      mov_imm64_to_reg(RDX, 0);
-      mov_reg_to_reg(RAX, lhsr);
-      div_reg_to_reg(rhsr);
-      mov_reg_to_reg(lhsr, RAX);
+    case ARITH_OP_DIV: // Written by write_div()
       break;
     }
-    return lhsr;
-  } else if (expr->type == ARITH_FUNC_CALL) {
-    func_call_t *func = expr->instance.func_call;
+    free_temp(rhs);
+    return lhs;
+  }
+  case NODE_CALL: {
+    ident_t name = ast->lhs[expr];
+    uint32_t argc = ast_call_argc(ast, expr);
     // TODO: verify params match func arg type and count
-    for (int i = 0; i < MAX_FUNC_ARGS; ++i) {
-      if (func->args[i] == NULL) {
-        break;
-      }
-      evaluate_expression_to_arith(func->args[i], param_regs[i], scope);
+    // Every argument is worked out before any is put in place, so working
+    // out one can't overwrite another
+    size_t args = call_args.len;
+    uint32_t held = (uint32_t)temps.len;
+    for (uint32_t i = 0; i < argc; ++i) {
+      uint32_t temp = _evaluate_arith_expression(ast_call_arg(ast, expr, i),
+                                                 scope);
+      VEC_PUSH(call_args, temp);
     }
-    // TODO: maybe hashmap it up? gotta make sure there is order though
-    for (size_t i = 0; i < symtab_len; ++i) {
-      Elf64_Sym sym = symtab[i];
-      char *fn_name = strtab + sym.st_name;
-      if (strcmp(func->name, fn_name) == 0) {
-        // Subtract the function's position by our current position,
-        // then subtract the size of call() instr (5) since its relative to the
-        // next instr
-        int32_t disp = (int32_t)(sym.st_value - text_get_pos()) - 5;
-        call_rel32(disp);
-        return RAX;
-      }
+    save_temps(held);
+    // Arguments past the registers are pushed right to left. RSP has to be
+    // 16 byte aligned at the call, an odd number of them is padded first.
+    size_t stack_args = 0;
+    if (argc > NUM_PARAM_REGS && (argc - NUM_PARAM_REGS) % 2 != 0) {
+      sub_imm(RSP, 8);
+      stack_args++;
     }
-    errx(EXIT_FAILURE, "no function named '%s'", func->name);
-  } else if (expr->type == ARITH_EXPR) {
-    reg_t reg = next_reg();
-    evaluate_arith_expression(expr->instance.expr, reg, scope);
-    return reg;
-  } else {
+    for (uint32_t i = argc; i > NUM_PARAM_REGS; --i) {
+      uint32_t temp = call_args.data[args + i - 1];
+      push(temp_reg(temp));
+      free_temp(temp);
+      stack_args++;
+    }
+    for (uint32_t i = 0; i < argc && i < NUM_PARAM_REGS; ++i) {
+      uint32_t temp = call_args.data[args + i];
+      if (reg_temps[param_regs[i]] != temp)
+        take_reg(param_regs[i]);
+      move_temp(temp, param_regs[i]);
+      regtab[param_regs[i]] = true;
+    }
+    call_args.len = args;
+
+    // Patched once every function is written, the prologue moves the call
+    // after it's written anyway
+    VEC_PUSH(call_fixups, ((call_fixup_t){text_get_pos(), name}));
+    call_rel32(0);
+    if (stack_args != 0)
+      add_imm(RSP, (int32_t)(stack_args * 8));
+    for (uint32_t i = 0; i < argc && i < NUM_PARAM_REGS; ++i)
+      regtab[param_regs[i]] = reserved_regs[param_regs[i]];
+
+    // The result is left where the call put it
+    take_reg(RAX);
+    uint32_t temp = (uint32_t)temps.len;
+    VEC_PUSH(temps, ((temp_t){.reg = RAX, .held = true}));
+    reg_temps[RAX] = temp;
+    return temp;
+  }
+  case NODE_PAREN:
+    return _evaluate_arith_expression(ast->lhs[expr], scope);
+  default:
     errx(EXIT_FAILURE, "unknown expression type");
   }
 }
 
-void evaluate_arith_expression(arith_expression_t *expr, reg_t result,
-                               scope_t *scope) {
-  reg_t r = _evaluate_arith_expression(expr, scope);
-  mov_reg_to_reg(result, r);
+void evaluate_arith_expression(node_t expr, reg_t result, scope_t *scope) {
+  move_temp(_evaluate_arith_expression(expr, scope), result);
 }
 
-void _evaluate_expression_to_cond(expression_t *expr, jmp_target_t cond_true,
+void _evaluate_expression_to_cond(node_t expr, jmp_target_t cond_true,
                                   jmp_target_t cond_false, unsigned int acc,
                                   jmptab_t *tab, scope_t *scope) {
-  if (expr->type == EXPR_BOOL) {
-    bool_operation_t *opr = expr->instance.bop;
-    if (opr->op == BOOL_OP_AND) {
-      _evaluate_expression_to_cond(opr->lhs, LABEL_NEXT_COND + acc, cond_false,
+  const ast_t *ast = gen_ast;
+  switch (ast->kind[expr]) {
+  case NODE_BOOL: {
+    node_t lhs = ast->lhs[expr];
+    node_t rhs = ast->rhs[expr];
+    switch ((bool_operator_t)ast->op[expr]) {
+    case BOOL_OP_AND: {
+      _evaluate_expression_to_cond(lhs, LABEL_NEXT_COND + acc, cond_false,
                                    acc * 2, tab, scope);
       size_t next_cond = text_get_pos();
       jmptab_eval(tab, LABEL_NEXT_COND + acc, next_cond);
-      _evaluate_expression_to_cond(opr->rhs, cond_true, cond_false, acc * 2 + 1,
+      _evaluate_expression_to_cond(rhs, cond_true, cond_false, acc * 2 + 1,
                                    tab, scope);
-    } else if (opr->op == BOOL_OP_OR) {
-      _evaluate_expression_to_cond(opr->lhs, cond_true, LABEL_NEXT_COND + acc,
+      break;
+    }
+    case BOOL_OP_OR: {
+      _evaluate_expression_to_cond(lhs, cond_true, LABEL_NEXT_COND + acc,
                                    acc * 2, tab, scope);
       size_t next_cond = text_get_pos();
       jmptab_eval(tab, LABEL_NEXT_COND + acc, next_cond);
-      _evaluate_expression_to_cond(opr->rhs, cond_true, cond_false, acc * 2 + 1,
+      _evaluate_expression_to_cond(rhs, cond_true, cond_false, acc * 2 + 1,
                                    tab, scope);
-    } else if (opr->op == BOOL_OP_NOT) {
-      _evaluate_expression_to_cond(opr->lhs, cond_false, cond_true, acc, tab,
+      break;
+    }
+    case BOOL_OP_NOT:
+      _evaluate_expression_to_cond(lhs, cond_false, cond_true, acc, tab,
                                    scope);
-    } else {
+      break;
+    default:
       errx(EXIT_FAILURE, "invalid boolean op");
     }
-  } else if (expr->type == EXPR_CMP) {
-    cmp_operation_t *cmp = expr->instance.cmp;
-    opcode_t opc = cmptab[cmp->op];
-    evaluate_arith_expression(cmp->lhs, RAX, scope);
-    evaluate_arith_expression(cmp->rhs, RBX, scope);
-    cmp_reg_to_reg(RAX, RBX);
+    break;
+  }
+  case NODE_CMP: {
+    opcode_t opc = cmptab[ast->op[expr]];
+    if (is_imm(ast->rhs[expr]) || is_imm(ast->lhs[expr])) {
+      // Only the right can be an immediate, a constant on the left swaps
+      // the sides and so the comparison
+      node_t num = ast->rhs[expr], other = ast->lhs[expr];
+      if (!is_imm(num)) {
+        num = ast->lhs[expr];
+        other = ast->rhs[expr];
+        opc = cmptab_swapped[ast->op[expr]];
+      }
+      uint32_t temp = _evaluate_arith_expression(other, scope);
+      cmp_imm(temp_reg(temp), (int32_t)ast_num(ast, num));
+      free_temp(temp);
+    } else {
+      uint32_t lhs, rhs;
+      evaluate_operands(expr, &lhs, &rhs, scope);
+      reg_t lhsr, rhsr;
+      temp_regs(lhs, rhs, &lhsr, &rhsr);
+      cmp_reg_to_reg(lhsr, rhsr);
+      free_temp(lhs);
+      free_temp(rhs);
+    }
     jmptab_insert(tab, text_get_pos(), cond_true, opc);
     write_jmp(opc, cond_true); // Placeholder
     jmptab_insert(tab, text_get_pos(), cond_false, J_REL32);
     write_jmp(J_REL32, cond_false); // Placeholder
-  } else if (expr->type == EXPR_ARITH) {
-    arith_expression_t *arith = expr->instance.aexpr;
-    evaluate_arith_expression(arith, RAX, scope);
-    cmp_reg_imm8(RAX, 0);
+    break;
+  }
+  case NODE_GROUP:
+    _evaluate_expression_to_cond(ast->lhs[expr], cond_true, cond_false, acc,
+                                 tab, scope);
+    break;
+  case NODE_NUM: {
+    // Already known, like the rest of a && or || that folding couldn't drop
+    jmp_target_t target = ast_num(ast, expr) != 0 ? cond_true : cond_false;
+    jmptab_insert(tab, text_get_pos(), target, J_REL32);
+    write_jmp(J_REL32, target); // Placeholder
+    break;
+  }
+  default:
+    // Any arithmetic expression, true when it's not zero
+    evaluate_arith_expression(expr, RAX, scope);
+    cmp_imm(RAX, 0);
     jmptab_insert(tab, text_get_pos(), cond_true, JNE_REL32);
     write_jmp(JNE_REL32, cond_true); // Placeholder
     jmptab_insert(tab, text_get_pos(), cond_false, J_REL32);
     write_jmp(J_REL32, cond_false); // Placeholder
-  } else if (expr->type == EXPR_EXPR) {
-    _evaluate_expression_to_cond(expr->instance.expr, cond_true, cond_false,
-                                 acc, tab, scope);
+    break;
   }
 }
 
-void evaluate_expression_to_cond(expression_t *expr, jmp_target_t cond_true,
+void evaluate_expression_to_cond(node_t expr, jmp_target_t cond_true,
                                  jmp_target_t cond_false, jmptab_t *tab,
                                  scope_t *scope) {
+  reset_regtab(expr);
   _evaluate_expression_to_cond(expr, cond_true, cond_false, 1, tab, scope);
-  reset_regtab();
 }
 
-void evaluate_expression_to_arith(expression_t *expr, reg_t result,
-                                  scope_t *scope) {
-  if (expr->type == EXPR_ARITH) {
-    evaluate_arith_expression(expr->instance.aexpr, result, scope);
+void evaluate_expression_to_arith(node_t expr, reg_t result, scope_t *scope) {
+  reset_regtab(expr);
+  if (ast_is_arith(gen_ast, expr)) {
+    evaluate_arith_expression(expr, result, scope);
   } else {
-    printf("%d\n", expr->type);
+    printf("%d\n", gen_ast->kind[expr]);
   }
-  reset_regtab();
 }
 
-void write_declare_statement(declare_statement_t *stmt, scope_t *scope,
-                             char **added_vars, uint8_t *added_vars_size) {
+void write_declare_statement(node_t stmt, scope_t *scope) {
   // We can discard type for now since we know it has to be an INT
-  if (scope_get(scope, stmt->name) != NULL)
-    errx(EXIT_FAILURE, "error: '%s' already declared", stmt->name);
+  ident_t name = gen_ast->lhs[stmt];
+  if (scope_get(scope, name) != NULL)
+    errx(EXIT_FAILURE, "error: '%s' already declared", ident_str(name));
 
-  // Size is by default 8 since INT is the only type
-  const scope_var_t *scope_var = scope_insert(scope, stmt->name, 8);
-  added_vars[(*added_vars_size)++] = stmt->name;
+  // The variable isn't in scope for its own value, but its register is free
+  reg_t reg = func_regs.vars.data[next_var++].reg;
+  evaluate_expression_to_arith(gen_ast->rhs[stmt],
+                               reg != NUM_REGISTERS ? reg : RAX, scope);
 
-  evaluate_expression_to_arith(stmt->expr, RAX, scope);
-  mov_reg_to_mem_offset(RAX, RBP, scope_var->position);
-  reset_regtab();
+  // Size is by default 8 since INT is the only type
+  const scope_var_t *scope_var = scope_insert_reg(scope, name, 8, false, reg);
+  if (reg == NUM_REGISTERS)
+    store_var(scope_var, RAX);
 }
 
-void write_ret_statement(ret_statement_t *stmt, scope_t *scope,
-                         jmptab_t *jmptab) {
-  evaluate_expression_to_arith(stmt->expr, RAX, scope);
+void write_ret_statement(node_t stmt, scope_t *scope, jmptab_t *jmptab) {
+  evaluate_expression_to_arith(gen_ast->lhs[stmt], RAX, scope);
   jmptab_insert(jmptab, text_get_pos(), LABEL_RET, J_REL32);
   write_jmp(J_REL32, LABEL_RET);
-  reset_regtab();
 }
 
-void write_assign_statement(assign_statement_t *stmt, scope_t *scope) {
+void write_assign_statement(node_t stmt, scope_t *scope) {
+  ident_t lhs = gen_ast->lhs[stmt];
   const scope_var_t *scope_var;
-  if ((scope_var = scope_get(scope, stmt->lhs)) == NULL)
-    errx(EXIT_FAILURE, "error: no variable '%s'", stmt->lhs);
+  if ((scope_var = scope_get(scope, lhs)) == NULL)
+    errx(EXIT_FAILURE, "error: no variable '%s'", ident_str(lhs));
   if (scope_var->immutable)
-    errx(EXIT_FAILURE, "error: '%s' is immutable", stmt->lhs);
+    errx(EXIT_FAILURE, "error: '%s' is immutable", ident_str(lhs));
+
+  if (scope_var->reg != NUM_REGISTERS) {
+    evaluate_expression_to_arith(gen_ast->rhs[stmt], scope_var->reg, scope);
+  } else {
+    evaluate_expression_to_arith(gen_ast->rhs[stmt], RAX, scope);
+    store_var(scope_var, RAX);
+  }
+}
 
-  evaluate_expression_to_arith(stmt->expr, RAX, scope);
-  mov_reg_to_mem_offset(RAX, RBP, scope_var->position);
-  reset_regtab();
+// Folding took out the ones that never run, the ones that always run are
+// just their block
+bool always_true(node_t cond) {
+  return gen_ast->kind[cond] == NODE_NUM && ast_num(gen_ast, cond) != 0;
 }
 
-void write_cond_statement(cond_statement_t *stmt, scope_t *scope,
-                          jmptab_t *superjmptab) {
+void write_cond_statement(node_t stmt, scope_t *scope, jmptab_t *superjmptab) {
+  if (always_true(gen_ast->lhs[stmt])) {
+    write_codeblock(gen_ast->rhs[stmt], scope, superjmptab);
+    return;
+  }
   jmptab_t *tab = jmptab_init();
-  evaluate_expression_to_cond(stmt->cond, LABEL_BLOCK_START, LABEL_BLOCK_END,
-                              tab, scope);
+  evaluate_expression_to_cond(gen_ast->lhs[stmt], LABEL_BLOCK_START,
+                              LABEL_BLOCK_END, tab, scope);
   jmptab_eval(tab, LABEL_BLOCK_START, text_get_pos());
   // For specificly conditional statements, we don't need to pass in tab and
   // merge since there aren't any keywords that will modify the flow in the
   // block
-  write_codeblock(stmt->code_block, scope, superjmptab);
+  write_codeblock(gen_ast->rhs[stmt], scope, superjmptab);
   jmptab_eval(tab, LABEL_BLOCK_END, text_get_pos());
   jmptab_free(tab);
 }
 
-void write_while_statement(while_statement_t *stmt, scope_t *scope,
-                           jmptab_t *superjmptab) {
+void write_while_statement(node_t stmt, scope_t *scope, jmptab_t *superjmptab) {
   jmptab_t *tab = jmptab_init();
   size_t loop_top_pos = text_get_pos();
-  evaluate_expression_to_cond(stmt->cond, LABEL_BLOCK_START, LABEL_BLOCK_END,
-                              tab, scope);
+  if (!always_true(gen_ast->lhs[stmt]))
+    evaluate_expression_to_cond(gen_ast->lhs[stmt], LABEL_BLOCK_START,
+                                LABEL_BLOCK_END, tab, scope);
   size_t blockpos = text_get_pos();
-  write_codeblock(stmt->code_block, scope, tab);
+  write_codeblock(gen_ast->rhs[stmt], scope, tab);
 
-  jmptab_insert(tab, text_len, LABEL_LOOP_START, J_REL32);
+  jmptab_insert(tab, text.len, LABEL_LOOP_START, J_REL32);
   write_jmp(J_REL32, LABEL_LOOP_START);
 
   jmptab_eval(tab, LABEL_LOOP_START, loop_top_pos);
@@ -484,170 +1237,227 @@ void write_while_statement(while_statement_t *stmt, scope_t *scope,
 }
 
 void write_cont_statement(jmptab_t *tab) {
-  jmptab_insert(tab, text_len, LABEL_LOOP_START, J_REL32);
+  jmptab_insert(tab, text.len, LABEL_LOOP_START, J_REL32);
   write_jmp(J_REL32, LABEL_LOOP_START);
 }
 
 void write_break_statement(jmptab_t *tab) {
-  jmptab_insert(tab, text_len, LABEL_BLOCK_END, J_REL32);
+  jmptab_insert(tab, text.len, LABEL_BLOCK_END, J_REL32);
   write_jmp(J_REL32, LABEL_BLOCK_END);
 }
 
-void write_statement(statement_t *stmt, scope_t *scope, char **added_vars,
-                     uint8_t *added_vars_size, jmptab_t *jmptab) {
-  switch (stmt->type) {
-  case STMT_DECLARE:
-    write_declare_statement(stmt->instance.declare, scope, added_vars,
-                            added_vars_size);
+void write_statement(node_t stmt, scope_t *scope, jmptab_t *jmptab) {
+  switch (gen_ast->kind[stmt]) {
+  case NODE_DECLARE:
+    write_declare_statement(stmt, scope);
     break;
-  case STMT_RET:
-    write_ret_statement(stmt->instance.ret, scope, jmptab);
+  case NODE_RET:
+    write_ret_statement(stmt, scope, jmptab);
     break;
-  case STMT_ASSIGN:
-    write_assign_statement(stmt->instance.assign, scope);
+  case NODE_ASSIGN:
+    write_assign_statement(stmt, scope);
     break;
-  case STMT_COND:
-    write_cond_statement(stmt->instance.cond, scope, jmptab);
+  case NODE_IF:
+    write_cond_statement(stmt, scope, jmptab);
     break;
-  case STMT_WHILE:
-    write_while_statement(stmt->instance.while_loop, scope, jmptab);
+  case NODE_WHILE:
+    write_while_statement(stmt, scope, jmptab);
     break;
-  case STMT_CONT:
+  case NODE_CONT:
     write_cont_statement(jmptab);
     break;
-  case STMT_BREAK:
+  case NODE_BREAK:
     write_break_statement(jmptab);
     break;
-  case STMT_EXPR:
-    evaluate_expression_to_arith(stmt->instance.expr, RAX, scope);
-    break;
-  default:
+  case NODE_BLOCK:
+  case NODE_FUNC:
     errx(EXIT_FAILURE, "unknown statement type in codegen");
+  default:
+    evaluate_expression_to_arith(stmt, RAX, scope);
+    break;
   }
 }
 
-void write_codeblock(code_block_t *block, scope_t *scope, jmptab_t *jmptab) {
-  char *added_vars[8] = {0};
-  uint8_t added_vars_size = 0;
-  for (statement_t **stmts = block->statements; *stmts != NULL; ++stmts) {
-    statement_t *stmt = *stmts;
-    write_statement(stmt, scope, added_vars, &added_vars_size, jmptab);
+void write_codeblock(node_t block, scope_t *scope, jmptab_t *jmptab) {
+  // Variables declared in the block go out of scope at its end
+  size_t mark = scope_mark(scope);
+  const node_t *stmts = gen_ast->extra.data + gen_ast->lhs[block];
+  for (uint32_t i = 0; i < gen_ast->rhs[block]; ++i)
+    write_statement(stmts[i], scope, jmptab);
+  scope_pop_to(scope, mark);
+}
+
+// Pushes the preserved registers the body wrote, sets up the frame and moves
+// the parameters to where the body expects them
+void write_prologue(node_t func, uint32_t frame_size) {
+  uint32_t saved = 0;
+  for (unsigned int i = 0; i < sizeof(prsrv_regs) / sizeof(reg_t); ++i) {
+    if (used_regs[prsrv_regs[i]]) {
+      push(prsrv_regs[i]);
+      saved++;
+    }
   }
-  for (uint8_t i = 0; i < added_vars_size; ++i) {
-    scope_remove(scope, added_vars[i]);
+
+  // Past the return address and the saved registers
+  int32_t caller_pos = (int32_t)(8 + saved * 8);
+  if (frame_reg == RBP) {
+    // Setup base pointer
+    push(RBP);
+    mov_reg_to_reg(RBP, RSP);
+    caller_pos += 8;
+
+    // Setup stack pointer, keeping it 16 byte aligned for calls. The return
+    // address and the pushes before it are already on the stack.
+    uint32_t frame = ((frame_size + saved * 8 + 15) & ~15u) - saved * 8;
+    if (frame != 0)
+      sub_imm(RSP, (int32_t)frame);
   }
-}
 
-uint32_t calc_stack_size(code_block_t *code_block) {
-  statement_t **s = code_block->statements;
-  uint32_t size = 0;
-  for (; *s != NULL; s++) {
-    statement_t *stmt = *s;
-    if (stmt->type == STMT_DECLARE) {
-      if (stmt->instance.declare->type == TYPE_INT64) {
-        size += 8;
+  uint32_t argc = ast_func_argc(gen_ast, func);
+  for (uint32_t i = 0; i < argc; ++i) {
+    const scope_var_t *var =
+        scope_get(func_scope, ast_func_arg_name(gen_ast, func, i));
+    if (i < NUM_PARAM_REGS) {
+      store_var(var, param_regs[i]);
+    } else {
+      int32_t pos = caller_pos + (int32_t)(i - NUM_PARAM_REGS) * 8;
+      if (var->reg != NUM_REGISTERS) {
+        mov_mem_offset_to_reg(var->reg, frame_reg, pos);
+      } else {
+        mov_mem_offset_to_reg(RAX, frame_reg, pos);
+        store_var(var, RAX);
       }
     }
   }
-  return size;
 }
 
-void write_func(function_t *func) {
-  // Create almost complete symbol (need section size)
-  Elf64_Sym sym = {
-      .st_name = (Elf64_Word)(strtab_len),
-      .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC),
-      .st_other = STV_DEFAULT,
-      .st_value = text_len,
-  };
+void write_epilogue() {
+  if (frame_reg == RBP) {
+    mov_reg_to_reg(RSP, RBP);
+    pop(RBP);
+  }
+  for (unsigned int i = sizeof(prsrv_regs) / sizeof(reg_t); i > 0; --i) {
+    if (used_regs[prsrv_regs[i - 1]])
+      pop(prsrv_regs[i - 1]);
+  }
+  ret();
+}
 
+// Writes the function at the end of the text, frame positions relative to
+// frame_reg. Returns how many bytes of locals the frame holds.
+uint32_t write_body(node_t func) {
   // Init scope
-  scope_t *scope = scope_init();
-  uint32_t stack_size = calc_stack_size(func->code_block);
-
-  // Setup base pointer
-  push(RBP);
-  mov_reg_to_reg(RBP, RSP);
-
-  // Save preserved registers
-  for (unsigned int i = 0; i < sizeof(prsrv_regs) / sizeof(reg_t); ++i) {
-    reg_t reg = prsrv_regs[i];
+  scope_t *scope = func_scope;
+  scope_reset(scope);
+  next_var = 0;
+  // It may be the second time round, after the frame didn't fit under RSP
+  regalloc_rewind(&func_regs);
+  memset(used_regs, 0, sizeof(used_regs));
+  for (size_t i = 0; i < func_regs.vars.len; ++i) {
+    if (func_regs.vars.data[i].reg != NUM_REGISTERS)
+      used_regs[func_regs.vars.data[i].reg] = true;
+  }
 
-    // Name it something easy to debug and add space to avoid collision
-    char *var_name = calloc(5, sizeof(char));
-    snprintf(var_name, 5, " %s", reg_names[reg]);
+  // Temps are spilled below the variables, how many slots they need is only
+  // known once the body is written
+  spill_base = -(int32_t)(scope->stacksize + func_regs.spilled * 8);
+  spill_slots = 0;
 
+  // Init parameters, they're moved to their homes by the prologue
+  uint32_t argc = ast_func_argc(gen_ast, func);
+  for (uint32_t i = 0; i < argc; ++i) {
+    ident_t arg_name = ast_func_arg_name(gen_ast, func, i);
     // Size is by default 8 since INT is the only type
-    const scope_var_t *var = scope_insert(scope, var_name, 8);
-    if (var == NULL) {
-      errx(EXIT_FAILURE, "error: variable already named '%s'... somehow??",
-           var_name);
-    }
-    mov_reg_to_mem_offset(reg, RBP, var->position);
-    stack_size += var->size;
-  }
-  // Init parameters
-  for (int i = 0; i < MAX_FUNC_ARGS; ++i) {
-    if (func->args[i] == NULL)
-      break;
-    char *arg_name = func->args[i]->name;
-    // Size is by default 8 since INT is the only type
-    const scope_var_t *var = scope_insert_immutable(scope, arg_name, 8, true);
+    const scope_var_t *var = scope_insert_reg(
+        scope, arg_name, 8, true, func_regs.vars.data[next_var++].reg);
     if (var == NULL) {
-      errx(EXIT_FAILURE, "error: argument already named '%s'", arg_name);
+      errx(EXIT_FAILURE, "error: argument already named '%s'",
+           ident_str(arg_name));
     }
-    mov_reg_to_mem_offset(param_regs[i], RBP, var->position);
-    stack_size += var->size;
   }
 
-  // Setup stack pointer
-  sub_imm32(RSP, (int32_t)stack_size);
-
   // Write code block
+  size_t body_start = text_get_pos();
+  size_t fixups_start = call_fixups.len;
   jmptab_t *jmptab = jmptab_init();
-  write_codeblock(func->code_block, scope, jmptab);
+  jmp_begin();
+  write_codeblock(ast_func_block(gen_ast, func), scope, jmptab);
 
   size_t ret_block = text_get_pos();
-
-  // Restore preserved registers
-  for (unsigned int i = 0; i < sizeof(prsrv_regs) / sizeof(reg_t); ++i) {
-    reg_t reg = prsrv_regs[i];
-
-    // Leave this
-    char var_name[5] = {0};
-    snprintf(var_name, sizeof(var_name), " %s", reg_names[reg]);
-
-    // Size is by default 8 since INT is the only type
-    const scope_var_t *var = scope_get(scope, var_name);
-    if (var == NULL) {
-      errx(EXIT_FAILURE, "error: no variable named '%s'...", reg_names[reg]);
-    }
-    mov_mem_offset_to_reg(reg, RBP, var->position);
-  }
-  mov_reg_to_reg(RSP, RBP);
-  pop(RBP);
-  ret();
+  write_epilogue();
 
   jmptab_eval(jmptab, LABEL_RET, ret_block);
 
   if (jmptab->first != NULL)
     errx(EXIT_FAILURE,
          "non-empty jump table, check for invalid breaks and continues");
+  jmptab_free(jmptab);
+
+  // Every jump is known now, the ones that can are shortened. Nothing after
+  // the function is written yet, only its own calls move.
+  text_set_pos(jmp_relax(text.data, body_start, text_get_pos()));
+  for (size_t i = fixups_start; i < call_fixups.len; ++i)
+    call_fixups.data[i].loc = jmp_moved(call_fixups.data[i].loc);
+
+  // Only now is it known which registers to save and how big the frame is,
+  // the prologue is written after the body and moved in front of it. Jumps
+  // in the body are relative so they don't mind, calls are patched later.
+  uint32_t frame_size = (uint32_t)(func_regs.spilled + spill_slots) * 8;
+  size_t body_end = text_get_pos();
+  write_prologue(func, frame_size);
+  size_t prologue_len = text_get_pos() - body_end;
+  prologue.len = 0;
+  VEC_RESERVE(prologue, prologue_len);
+  memcpy(prologue.data, text.data + body_end, prologue_len);
+  memmove(text.data + body_start + prologue_len, text.data + body_start,
+          body_end - body_start);
+  memcpy(text.data + body_start, prologue.data, prologue_len);
+  for (size_t i = fixups_start; i < call_fixups.len; ++i)
+    call_fixups.data[i].loc += prologue_len;
+  return frame_size;
+}
+
+void write_func(node_t func) {
+  ident_t func_name = gen_ast->lhs[func];
+  if (get_func_sym(func_name) != NULL)
+    errx(EXIT_FAILURE, "error: function '%s' already defined",
+         ident_str(func_name));
+
+  // Create almost complete symbol (need section size)
+  Elf64_Sym sym = {
+      .st_name = strtab_offset(func_name),
+      .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC),
+      .st_other = STV_DEFAULT,
+      .st_value = text.len,
+  };
 
-  // Add to strtab
-  append_strtab(func->name);
-  sym.st_size = text_len;
+  regalloc_func(&func_regs, gen_ast, func);
+  frame_reg = omit_frame_pointer && func_regs.leaf ? RSP : RBP;
+  uint32_t frame_size = write_body(func);
+  if (frame_reg == RSP && frame_size > RED_ZONE) {
+    // Too much spilled to fit under RSP, write it again with a frame
+    text_set_pos(sym.st_value);
+    frame_reg = RBP;
+    write_body(func);
+  }
 
-  symtab[symtab_len++] = sym;
+  sym.st_size = text.len - sym.st_value;
+
+  IDENT_TABLE_FIT(func_syms, func_syms_len, func_name);
+  func_syms[func_name] = symtab.len;
+  VEC_PUSH(symtab, sym);
 }
 
-void gen_object(function_t **funcs, const char *file) {
-  memset(strtab, 0, sizeof(strtab));
-  memset(symtab, 0, sizeof(symtab));
-  memset(text, 0, sizeof(text));
-  strtab_len = 1;
-  symtab_len = 2;
-  text_len = 0;
+void gen_begin() {
+  strtab.len = 0;
+  symtab.len = 0;
+  text.len = 0;
+  call_fixups.len = 0;
+  func_scope = scope_init();
+
+  // The first symbol and name are always null
+  VEC_PUSH(symtab, (Elf64_Sym){0});
+  VEC_PUSH(strtab, '\0');
 
   Elf64_Sym text_sym = {
       .st_name = 1,
@@ -656,12 +1466,37 @@ void gen_object(function_t **funcs, const char *file) {
       .st_value = 0,
       .st_size = 0,
   };
-  symtab[1] = text_sym;
+  VEC_PUSH(symtab, text_sym);
   append_strtab(".text");
+}
 
-  for (; *funcs != NULL; funcs++) {
-    write_func(*funcs);
+void gen_omit_frame_pointer(bool omit) { omit_frame_pointer = omit; }
+
+void gen_func(const ast_t *ast, node_t func) {
+  gen_ast = ast;
+  write_func(func);
+}
+
+void gen_end(const char *file) {
+  size_t end = text_get_pos();
+  for (size_t i = 0; i < call_fixups.len; ++i) {
+    call_fixup_t *fixup = &call_fixups.data[i];
+    const Elf64_Sym *sym = get_func_sym(fixup->name);
+    if (sym == NULL)
+      errx(EXIT_FAILURE, "no function named '%s'", ident_str(fixup->name));
+    text_set_pos(fixup->loc);
+    call_rel32(call_disp(sym, fixup->loc));
   }
+  text_set_pos(end);
+
+  write_obj(file, symtab.data, text.data, strtab.data, symtab.len, text.len,
+            strtab.len);
+}
 
-  write_obj(file, symtab, text, strtab, symtab_len, text_len, strtab_len);
+void gen_object(const ast_t *ast, const char *file) {
+  gen_begin();
+  for (size_t i = 0; i < ast->funcs.len; ++i) {
+    gen_func(ast, ast->funcs.data[i]);
+  }
+  gen_end(file);
 }
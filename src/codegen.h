@@ -5,7 +5,14 @@
 #include "parse.h"
 #include "instr.h"
 
-void gen_object(function_t **funcs, const char *file);
+// A whole AST at once, or one function at a time between gen_begin() and
+// gen_end() so each function's AST can be dropped as soon as it's written
+void gen_object(const ast_t *ast, const char *file);
+void gen_begin();
+// Leaf functions address their locals off RSP and skip setting up RBP
+void gen_omit_frame_pointer(bool omit);
+void gen_func(const ast_t *ast, node_t func);
+void gen_end(const char *file);
 void write_jmp(opcode_t opc, int32_t dest);
 void text_set_pos(size_t pos);
 size_t text_get_pos();
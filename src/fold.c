@@ -0,0 +1,323 @@
+#include "fold.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void set_num(ast_t *ast, node_t node, int64_t value) {
+  ast->kind[node] = NODE_NUM;
+  ast->op[node] = 0;
+  ast->lhs[node] = (uint32_t)value;
+  ast->rhs[node] = (uint32_t)((uint64_t)value >> 32);
+}
+
+// The node becomes its child, the child is left unreferenced. Whatever sits
+// between them is dead, it's turned into numbers so nothing in the node's
+// range refers to nodes before where it now starts.
+void replace_with(ast_t *ast, node_t node, node_t child) {
+  ast->kind[node] = ast->kind[child];
+  ast->op[node] = ast->op[child];
+  ast->lhs[node] = ast->lhs[child];
+  ast->rhs[node] = ast->rhs[child];
+  for (node_t dead = child + 1; dead < node; ++dead)
+    set_num(ast, dead, 0);
+}
+
+bool is_num(const ast_t *ast, node_t node, int64_t value) {
+  return ast->kind[node] == NODE_NUM && ast_num(ast, node) == value;
+}
+
+// Only calls do anything besides giving a value. Nodes that folding left
+// unreferenced are looked at too, which is just cautious.
+bool has_call(const ast_t *ast, node_t node) {
+  for (node_t n = ast_first(ast, node); n <= node; ++n) {
+    if (ast->kind[n] == NODE_CALL)
+      return true;
+  }
+  return false;
+}
+
+// Subtrees are contiguous, so two are the same when their nodes are, with
+// children compared relative to where each subtree starts
+bool same_tree(const ast_t *ast, node_t a, node_t b) {
+  node_t first_a = ast_first(ast, a);
+  node_t first_b = ast_first(ast, b);
+  if (a - first_a != b - first_b)
+    return false;
+  for (node_t i = 0; i <= a - first_a; ++i) {
+    node_t na = first_a + i;
+    node_t nb = first_b + i;
+    if (ast->kind[na] != ast->kind[nb] || ast->op[na] != ast->op[nb])
+      return false;
+    switch (ast->kind[na]) {
+    case NODE_NUM:
+    case NODE_IDENT:
+      if (ast->lhs[na] != ast->lhs[nb] || ast->rhs[na] != ast->rhs[nb])
+        return false;
+      break;
+    case NODE_ARITH:
+      if (ast->rhs[na] - first_a != ast->rhs[nb] - first_b)
+        return false;
+      // fall through
+    case NODE_PAREN:
+      if (ast->lhs[na] - first_a != ast->lhs[nb] - first_b)
+        return false;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// A + or - with a constant operand, x + c, c + x or x - c. Gives the other
+// operand, the constant and the sign it's added with.
+bool split_add(const ast_t *ast, node_t node, node_t *x, node_t *c,
+               int *sign) {
+  if (ast->kind[node] != NODE_ARITH)
+    return false;
+  node_t lhs = ast->lhs[node];
+  node_t rhs = ast->rhs[node];
+  switch ((arith_operator_t)ast->op[node]) {
+  case ARITH_OP_ADD:
+    *sign = 1;
+    if (ast->kind[lhs] == NODE_NUM) {
+      *x = rhs;
+      *c = lhs;
+      return true;
+    }
+    break;
+  case ARITH_OP_SUB:
+    *sign = -1;
+    break;
+  default:
+    return false;
+  }
+  if (ast->kind[rhs] != NODE_NUM)
+    return false;
+  *x = lhs;
+  *c = rhs;
+  return true;
+}
+
+// A * with a constant operand
+bool split_mul(const ast_t *ast, node_t node, node_t *x, node_t *c) {
+  if (ast->kind[node] != NODE_ARITH || ast->op[node] != ARITH_OP_MUL)
+    return false;
+  node_t lhs = ast->lhs[node];
+  node_t rhs = ast->rhs[node];
+  if (ast->kind[rhs] == NODE_NUM) {
+    *x = lhs;
+    *c = rhs;
+    return true;
+  }
+  if (ast->kind[lhs] == NODE_NUM) {
+    *x = rhs;
+    *c = lhs;
+    return true;
+  }
+  return false;
+}
+
+// Makes node x op c, keeping its operands in node order. The constant goes
+// in whichever of the two constants comes first, so the subtree still
+// starts at its first operand.
+void set_chain(ast_t *ast, node_t node, arith_operator_t op, node_t x,
+               node_t c1, node_t c2, uint64_t value) {
+  node_t c = c1 < c2 ? c1 : c2;
+  set_num(ast, c, (int64_t)value);
+  ast->op[node] = op;
+  ast->lhs[node] = x < c ? x : c;
+  ast->rhs[node] = x < c ? c : x;
+}
+
+// Merges (x + c1) + c2 into x + (c1 + c2), likewise with - and *. The inner
+// node is dead after, and made a number like replace_with() does.
+void reassociate(ast_t *ast, node_t node) {
+  node_t outer_x, outer_c, x, c;
+  int outer_sign, sign;
+  if (split_add(ast, node, &outer_x, &outer_c, &outer_sign) &&
+      split_add(ast, outer_x, &x, &c, &sign)) {
+    uint64_t value = (uint64_t)ast_num(ast, c) * (uint64_t)(int64_t)sign +
+                     (uint64_t)ast_num(ast, outer_c) *
+                         (uint64_t)(int64_t)outer_sign;
+    set_chain(ast, node, ARITH_OP_ADD, x, c, outer_c, value);
+    set_num(ast, outer_x, 0);
+  } else if (split_mul(ast, node, &outer_x, &outer_c) &&
+             split_mul(ast, outer_x, &x, &c)) {
+    uint64_t value =
+        (uint64_t)ast_num(ast, c) * (uint64_t)ast_num(ast, outer_c);
+    set_chain(ast, node, ARITH_OP_MUL, x, c, outer_c, value);
+    set_num(ast, outer_x, 0);
+  }
+}
+
+void fold_arith(ast_t *ast, node_t node) {
+  node_t lhs = ast->lhs[node];
+  node_t rhs = ast->rhs[node];
+  if (ast->kind[lhs] == NODE_NUM && ast->kind[rhs] == NODE_NUM) {
+    // Wraps like the instructions do
+    uint64_t a = (uint64_t)ast_num(ast, lhs);
+    uint64_t b = (uint64_t)ast_num(ast, rhs);
+    switch ((arith_operator_t)ast->op[node]) {
+    case ARITH_OP_ADD:
+      set_num(ast, node, (int64_t)(a + b));
+      break;
+    case ARITH_OP_SUB:
+      set_num(ast, node, (int64_t)(a - b));
+      break;
+    case ARITH_OP_MUL:
+      set_num(ast, node, (int64_t)(a * b));
+      break;
+    case ARITH_OP_DIV:
+      // Signed like idiv, the divisions it faults on are left for run time
+      if (b != 0 && !((int64_t)a == INT64_MIN && (int64_t)b == -1))
+        set_num(ast, node, (int64_t)a / (int64_t)b);
+      break;
+    }
+    return;
+  }
+
+  reassociate(ast, node);
+  lhs = ast->lhs[node];
+  rhs = ast->rhs[node];
+
+  switch ((arith_operator_t)ast->op[node]) {
+  case ARITH_OP_ADD:
+    if (is_num(ast, lhs, 0))
+      replace_with(ast, node, rhs);
+    else if (is_num(ast, rhs, 0))
+      replace_with(ast, node, lhs);
+    break;
+  case ARITH_OP_SUB:
+    if (is_num(ast, rhs, 0))
+      replace_with(ast, node, lhs);
+    else if (same_tree(ast, lhs, rhs) && !has_call(ast, lhs))
+      set_num(ast, node, 0);
+    break;
+  case ARITH_OP_MUL:
+    if (is_num(ast, lhs, 1))
+      replace_with(ast, node, rhs);
+    else if (is_num(ast, rhs, 1))
+      replace_with(ast, node, lhs);
+    else if ((is_num(ast, lhs, 0) && !has_call(ast, rhs)) ||
+             (is_num(ast, rhs, 0) && !has_call(ast, lhs)))
+      set_num(ast, node, 0);
+    break;
+  case ARITH_OP_DIV:
+    if (is_num(ast, rhs, 1))
+      replace_with(ast, node, lhs);
+    break;
+  }
+}
+
+void fold_cmp(ast_t *ast, node_t node) {
+  node_t lhs = ast->lhs[node];
+  node_t rhs = ast->rhs[node];
+  if (ast->kind[lhs] != NODE_NUM || ast->kind[rhs] != NODE_NUM)
+    return;
+  // Signed, like the jumps it's written as
+  int64_t a = ast_num(ast, lhs);
+  int64_t b = ast_num(ast, rhs);
+  switch ((cmp_operator_t)ast->op[node]) {
+  case CMP_OP_LT:
+    set_num(ast, node, a < b);
+    break;
+  case CMP_OP_GT:
+    set_num(ast, node, a > b);
+    break;
+  case CMP_OP_LTE:
+    set_num(ast, node, a <= b);
+    break;
+  case CMP_OP_GTE:
+    set_num(ast, node, a >= b);
+    break;
+  case CMP_OP_EQU:
+    set_num(ast, node, a == b);
+    break;
+  case CMP_OP_NEQ:
+    set_num(ast, node, a != b);
+    break;
+  }
+}
+
+// A condition is true when it isn't zero. The right of && and || only runs
+// when the left doesn't decide, so it can be dropped when the left does, but
+// a left with a call has to stay.
+void fold_bool(ast_t *ast, node_t node) {
+  node_t lhs = ast->lhs[node];
+  node_t rhs = ast->rhs[node];
+  switch ((bool_operator_t)ast->op[node]) {
+  case BOOL_OP_NOT:
+    if (ast->kind[lhs] == NODE_NUM)
+      set_num(ast, node, ast_num(ast, lhs) == 0);
+    break;
+  case BOOL_OP_AND:
+    if (ast->kind[lhs] == NODE_NUM) {
+      if (ast_num(ast, lhs) == 0)
+        set_num(ast, node, 0);
+      else
+        replace_with(ast, node, rhs);
+    } else if (ast->kind[rhs] == NODE_NUM) {
+      if (ast_num(ast, rhs) != 0)
+        replace_with(ast, node, lhs);
+      else if (!has_call(ast, lhs))
+        set_num(ast, node, 0);
+    }
+    break;
+  case BOOL_OP_OR:
+    if (ast->kind[lhs] == NODE_NUM) {
+      if (ast_num(ast, lhs) != 0)
+        set_num(ast, node, 1);
+      else
+        replace_with(ast, node, rhs);
+    } else if (ast->kind[rhs] == NODE_NUM) {
+      if (ast_num(ast, rhs) == 0)
+        replace_with(ast, node, lhs);
+      else if (!has_call(ast, lhs))
+        set_num(ast, node, 1);
+    }
+    break;
+  }
+}
+
+// Drops the ifs and whiles whose condition is always false
+void fold_block(ast_t *ast, node_t block) {
+  node_t *stmts = ast->extra.data + ast->lhs[block];
+  uint32_t len = 0;
+  for (uint32_t i = 0; i < ast->rhs[block]; ++i) {
+    node_t stmt = stmts[i];
+    if ((ast->kind[stmt] == NODE_IF || ast->kind[stmt] == NODE_WHILE) &&
+        is_num(ast, ast->lhs[stmt], 0))
+      continue;
+    stmts[len++] = stmt;
+  }
+  ast->rhs[block] = len;
+}
+
+void fold_func(ast_t *ast, node_t func) {
+  // Children come before their parents, so one pass in node order sees
+  // every operand folded before what uses it
+  node_t block = ast_func_block(ast, func);
+  for (node_t node = ast_first(ast, block); node <= block; ++node) {
+    switch (ast->kind[node]) {
+    case NODE_ARITH:
+      fold_arith(ast, node);
+      break;
+    case NODE_PAREN:
+    case NODE_GROUP:
+      replace_with(ast, node, ast->lhs[node]);
+      break;
+    case NODE_CMP:
+      fold_cmp(ast, node);
+      break;
+    case NODE_BOOL:
+      fold_bool(ast, node);
+      break;
+    case NODE_BLOCK:
+      fold_block(ast, node);
+      break;
+    default:
+      break;
+    }
+  }
+}
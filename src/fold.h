@@ -0,0 +1,13 @@
+#ifndef _FOLD_H
+#define _FOLD_H
+
+#include "ast.h"
+
+// Folds the constant parts of a function in place: constant subtrees become
+// numbers, identities like x + 0 and x * 1 are dropped, constant chains like
+// (x + 1) + 2 are merged, and ifs and whiles that can never run are taken out
+// of their blocks. Nodes are only ever rewritten, never added, so node order
+// stays the order code runs in.
+void fold_func(ast_t *ast, node_t func);
+
+#endif // _FOLD_H
@@ -29,6 +29,9 @@ mod_t mod = 0;
 uint8_t reg = 0;
 uint8_t rm = 0;
 
+bool has_sib = false;
+uint8_t sib = 0;
+
 uint8_t imm[8];
 uint8_t imm_size = 0;
 
@@ -83,6 +86,8 @@ uint8_t instr_flush(uint8_t **buf) {
   if (modregrm) {
     append_uint8((uint8_t)((mod << 6) | (reg << 3) | rm));
   }
+  if (has_sib)
+    append_uint8(sib);
 
   if (imm_size != 0)
     append_buf(imm, imm_size);
@@ -93,6 +98,8 @@ uint8_t instr_flush(uint8_t **buf) {
   mod = 0;
   reg = 0;
   rm = 0;
+  has_sib = false;
+  sib = 0;
   rex_prefix = 0;
   opc_type = SINGLE_BYTE;
   opc_byte = 0x00;
@@ -126,6 +133,11 @@ void instr_set_rm(uint8_t r) {
   modregrm = true;
   rm = r & 0x07;
 }
+void instr_set_sib(uint8_t s) {
+  has_sib = true;
+  sib = s;
+}
+
 void instr_set_disp8(uint8_t i) { INT_TO_BYTEARR(disp, i, 1); }
 void instr_set_disp16(uint16_t i) { INT_TO_BYTEARR(disp, i, 2); }
 void instr_set_disp32(uint32_t i) { INT_TO_BYTEARR(disp, i, 4); }
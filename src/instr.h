@@ -47,16 +47,36 @@ typedef enum _opcode : uint32_t {
   MOV_R_IMM = 1,
   MOV_R_RM,
   MOV_RM_R,
+  MOV_RM_IMM,
+  ADD_EAX_IMM,
+  ADD_RM_IMM,
+  ADD_RM_IMM8,
   SUB_EAX_IMM,
   SUB_RM_IMM,
+  SUB_RM_IMM8,
+  AND_EAX_IMM,
+  AND_RM_IMM,
+  AND_RM_IMM8,
   ADD_R_RM,
   SUB_R_RM,
   IMUL_R_RM,
+  IMUL_R_RM_IMM,
+  IMUL_R_RM_IMM8,
   DIV_RM,
+  IDIV_RM,
+  IMUL_RM,
+  NEG_RM,
+  CQO,
+  SHL_RM_IMM8,
+  SHR_RM_IMM8,
+  SAR_RM_IMM8,
+  LEA_R_M,
   PUSH_R,
   POP_R,
   RET_NEAR,
   CALL_REL32,
+  CMP_EAX_IMM,
+  CMP_RM_IMM,
   CMP_RM_IMM8,
   CMP_R_RM,
   JE_REL32,
@@ -65,7 +85,14 @@ typedef enum _opcode : uint32_t {
   JGE_REL32,
   JL_REL32,
   JLE_REL32,
-  J_REL32
+  J_REL32,
+  JE_REL8,
+  JNE_REL8,
+  JG_REL8,
+  JGE_REL8,
+  JL_REL8,
+  JLE_REL8,
+  J_REL8
 } opcode_t;
 
 typedef enum _mod : uint8_t {
@@ -78,17 +105,28 @@ typedef enum _mod : uint8_t {
 static const uint8_t opcode_enc_map[] = {
     [MOV_R_IMM] = 0xB8,   [MOV_R_RM] = 0x89,    [MOV_RM_R] = 0x8B,
     [SUB_EAX_IMM] = 0x2D, [SUB_RM_IMM] = 0x81,  [ADD_R_RM] = 0x03,
+    [ADD_RM_IMM] = 0x81,
     [SUB_R_RM] = 0x2B,    [IMUL_R_RM] = 0xAF,   [PUSH_R] = 0x50,
     [POP_R] = 0x58,       [RET_NEAR] = 0xC3,    [DIV_RM] = 0xF7,
     [CALL_REL32] = 0xE8,  [CMP_RM_IMM8] = 0x83, [CMP_R_RM] = 0x39,
     [JE_REL32] = 0x84,    [J_REL32] = 0xE9,     [JNE_REL32] = 0x85,
     [JG_REL32] = 0x8F,    [JGE_REL32] = 0x8D,   [JL_REL32] = 0x8C,
-    [JLE_REL32] = 0x8E};
+    [JLE_REL32] = 0x8E,   [IDIV_RM] = 0xF7,     [IMUL_RM] = 0xF7,
+    [NEG_RM] = 0xF7,      [CQO] = 0x99,         [SHL_RM_IMM8] = 0xC1,
+    [SHR_RM_IMM8] = 0xC1, [SAR_RM_IMM8] = 0xC1, [LEA_R_M] = 0x8D,
+    [MOV_RM_IMM] = 0xC7,  [ADD_EAX_IMM] = 0x05, [ADD_RM_IMM8] = 0x83,
+    [SUB_RM_IMM8] = 0x83, [AND_EAX_IMM] = 0x25, [AND_RM_IMM] = 0x81,
+    [AND_RM_IMM8] = 0x83, [CMP_EAX_IMM] = 0x3D, [CMP_RM_IMM] = 0x81,
+    [IMUL_R_RM_IMM] = 0x69, [IMUL_R_RM_IMM8] = 0x6B,
+    [JE_REL8] = 0x74,     [JNE_REL8] = 0x75,    [JG_REL8] = 0x7F,
+    [JGE_REL8] = 0x7D,    [JL_REL8] = 0x7C,     [JLE_REL8] = 0x7E,
+    [J_REL8] = 0xEB};
 
 static const opcode_type_t opcode_type_map[] = {
     [MOV_R_IMM] = SINGLE_BYTE,  [MOV_R_RM] = SINGLE_BYTE,
     [MOV_RM_R] = SINGLE_BYTE,   [SUB_EAX_IMM] = SINGLE_BYTE,
     [SUB_RM_IMM] = SINGLE_BYTE, [ADD_R_RM] = SINGLE_BYTE,
+    [ADD_RM_IMM] = SINGLE_BYTE,
     [IMUL_R_RM] = DOUBLE_BYTE,  [PUSH_R] = SINGLE_BYTE,
     [POP_R] = SINGLE_BYTE,      [RET_NEAR] = SINGLE_BYTE,
     [SUB_R_RM] = SINGLE_BYTE,   [DIV_RM] = SINGLE_BYTE,
@@ -96,7 +134,21 @@ static const opcode_type_t opcode_type_map[] = {
     [JE_REL32] = DOUBLE_BYTE,   [JNE_REL32] = DOUBLE_BYTE,
     [JL_REL32] = DOUBLE_BYTE,   [JLE_REL32] = DOUBLE_BYTE,
     [JG_REL32] = DOUBLE_BYTE,   [JGE_REL32] = DOUBLE_BYTE,
-    [J_REL32] = SINGLE_BYTE,    [CMP_R_RM] = SINGLE_BYTE};
+    [J_REL32] = SINGLE_BYTE,    [CMP_R_RM] = SINGLE_BYTE,
+    [IDIV_RM] = SINGLE_BYTE,    [IMUL_RM] = SINGLE_BYTE,
+    [NEG_RM] = SINGLE_BYTE,     [CQO] = SINGLE_BYTE,
+    [SHL_RM_IMM8] = SINGLE_BYTE, [SHR_RM_IMM8] = SINGLE_BYTE,
+    [SAR_RM_IMM8] = SINGLE_BYTE, [LEA_R_M] = SINGLE_BYTE,
+    [MOV_RM_IMM] = SINGLE_BYTE, [ADD_EAX_IMM] = SINGLE_BYTE,
+    [ADD_RM_IMM8] = SINGLE_BYTE, [SUB_RM_IMM8] = SINGLE_BYTE,
+    [AND_EAX_IMM] = SINGLE_BYTE, [AND_RM_IMM] = SINGLE_BYTE,
+    [AND_RM_IMM8] = SINGLE_BYTE, [CMP_EAX_IMM] = SINGLE_BYTE,
+    [CMP_RM_IMM] = SINGLE_BYTE, [IMUL_R_RM_IMM] = SINGLE_BYTE,
+    [IMUL_R_RM_IMM8] = SINGLE_BYTE,
+    [JE_REL8] = SINGLE_BYTE,    [JNE_REL8] = SINGLE_BYTE,
+    [JG_REL8] = SINGLE_BYTE,    [JGE_REL8] = SINGLE_BYTE,
+    [JL_REL8] = SINGLE_BYTE,    [JLE_REL8] = SINGLE_BYTE,
+    [J_REL8] = SINGLE_BYTE};
 
 uint8_t instr_flush(uint8_t **buf);
 void instr_set_opcode(opcode_t opc);
@@ -105,6 +157,7 @@ void instr_set_rex(rex_flags_t rex);
 void instr_set_mod(mod_t mod);
 void instr_set_reg(reg_t reg);
 void instr_set_rm(uint8_t rm);
+void instr_set_sib(uint8_t sib);
 void instr_set_imm8(uint8_t i);
 void instr_set_imm16(uint16_t i);
 void instr_set_imm32(uint32_t i);
@@ -0,0 +1,112 @@
+#include "intern.h"
+#include "hashmap.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE (64 * 1024)
+
+typedef struct _intern_str {
+  const char *str;
+  size_t len;
+} intern_str_t;
+
+hashmap_t intern_map;
+bool intern_ready = false;
+pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// What this thread has already looked up, so threads lexing in parallel
+// only take the lock the first time they see an identifier
+_Thread_local hashmap_t local_map;
+_Thread_local bool local_ready = false;
+
+// Strings are never moved since the map holds pointers to them as keys
+char *chunk = NULL;
+size_t chunk_len = 0;
+size_t chunk_cap = 0;
+
+intern_str_t *strs = NULL;
+size_t strs_len = 0;
+size_t strs_cap = 0;
+
+char *store_str(const char *str, size_t len) {
+  if (chunk == NULL || chunk_len + len + 1 > chunk_cap) {
+    chunk_cap = len + 1 > CHUNK_SIZE ? len + 1 : CHUNK_SIZE;
+    chunk = malloc(chunk_cap);
+    chunk_len = 0;
+    if (chunk == NULL)
+      err(EXIT_FAILURE, "failed to allocate string storage");
+  }
+  char *dst = chunk + chunk_len;
+  memcpy(dst, str, len);
+  dst[len] = '\0';
+  chunk_len += len + 1;
+  return dst;
+}
+
+ident_t intern_locked(const char *str, size_t len) {
+  if (!intern_ready) {
+    if (hashmap_create(1024, &intern_map) != 0)
+      errx(EXIT_FAILURE, "failed to create intern table");
+    intern_ready = true;
+  }
+
+  // IDs are stored off by one so that NULL means not found
+  void *found = hashmap_get(&intern_map, str, (unsigned int)len);
+  if (found != NULL)
+    return (ident_t)((uintptr_t)found - 1);
+
+  if (strs_len == strs_cap) {
+    strs_cap = strs_cap == 0 ? 256 : strs_cap * 2;
+    strs = realloc(strs, strs_cap * sizeof(intern_str_t));
+    if (strs == NULL)
+      err(EXIT_FAILURE, "failed to grow intern table");
+  }
+
+  ident_t id = (ident_t)strs_len;
+  char *copy = store_str(str, len);
+  strs[strs_len++] = (intern_str_t){copy, len};
+  if (hashmap_put(&intern_map, copy, (unsigned int)len,
+                  (void *)((uintptr_t)id + 1)) != 0)
+    errx(EXIT_FAILURE, "failed to intern '%s'", copy);
+  return id;
+}
+
+ident_t intern(const char *str, size_t len) {
+  if (!local_ready) {
+    if (hashmap_create(256, &local_map) != 0)
+      errx(EXIT_FAILURE, "failed to create intern table");
+    local_ready = true;
+  }
+
+  void *found = hashmap_get(&local_map, str, (unsigned int)len);
+  if (found != NULL)
+    return (ident_t)((uintptr_t)found - 1);
+
+  pthread_mutex_lock(&intern_lock);
+  ident_t id = intern_locked(str, len);
+  // The stored copy outlives this thread's map, so it can be the key
+  const char *copy = strs[id].str;
+  pthread_mutex_unlock(&intern_lock);
+
+  if (hashmap_put(&local_map, copy, (unsigned int)len,
+                  (void *)((uintptr_t)id + 1)) != 0)
+    errx(EXIT_FAILURE, "failed to intern '%s'", copy);
+  return id;
+}
+
+void intern_thread_done() {
+  if (local_ready) {
+    hashmap_destroy(&local_map);
+    local_ready = false;
+  }
+}
+
+ident_t intern_cstr(const char *str) { return intern(str, strlen(str)); }
+
+const char *ident_str(ident_t id) { return strs[id].str; }
+size_t ident_len(ident_t id) { return strs[id].len; }
+size_t ident_count() { return strs_len; }
@@ -0,0 +1,23 @@
+#ifndef _INTERN_H
+#define _INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every distinct identifier gets a small dense ID at lex time, so the rest
+// of the compiler can index tables by it instead of hashing strings
+typedef uint32_t ident_t;
+
+#define IDENT_NONE UINT32_MAX
+
+// Interning is safe from any thread. Looking IDs up is not while another
+// thread might still be interning.
+ident_t intern(const char *str, size_t len);
+ident_t intern_cstr(const char *str);
+// Drops the calling thread's cache of looked up identifiers
+void intern_thread_done();
+const char *ident_str(ident_t id);
+size_t ident_len(ident_t id);
+size_t ident_count();
+
+#endif // _INTERN_H
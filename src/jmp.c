@@ -1,9 +1,34 @@
 #include "jmp.h"
 #include "codegen.h"
+#include "vec.h"
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define UNCOND_JMP_SIZE 5
 #define COND_JMP_SIZE 6
+#define SHORT_JMP_SIZE 2
+
+typedef struct _branch {
+  size_t loc;   // Where its near form was written
+  size_t dest;  // Where it goes, before relaxing
+  opcode_t op;  // Its near form
+  uint8_t size; // What it's relaxed to
+} branch_t;
+
+VEC(branch_t) branches;
+// Bytes saved by the branches before each one, then by all of them
+VEC(size_t) shrunk;
+
+const opcode_t short_jmps[] = {
+    [JE_REL32] = JE_REL8, [JNE_REL32] = JNE_REL8, [JG_REL32] = JG_REL8,
+    [JGE_REL32] = JGE_REL8, [JL_REL32] = JL_REL8, [JLE_REL32] = JLE_REL8,
+    [J_REL32] = J_REL8};
+
+uint8_t near_size(opcode_t op) {
+  return op == J_REL32 ? UNCOND_JMP_SIZE : COND_JMP_SIZE;
+}
 
 jmptab_t *jmptab_init() {
   jmptab_t *tab = malloc(sizeof(jmptab_t));
@@ -56,10 +81,8 @@ void jmptab_eval(jmptab_t *tab, jmp_target_t target, size_t value) {
   while (jmp != NULL) {
     if (jmp->target == target) {
       text_set_pos(jmp->loc);
-      size_t size = COND_JMP_SIZE;
-      if (jmp->op == J_REL32)
-        size = UNCOND_JMP_SIZE;
-      write_jmp(jmp->op, (int32_t)(value - jmp->loc - size));
+      write_jmp(jmp->op, (int32_t)(value - jmp->loc - near_size(jmp->op)));
+      VEC_PUSH(branches, ((branch_t){jmp->loc, value, jmp->op, 0}));
 
       jmp_t *tmp = jmp->next;
       jmptab_remove(tab, jmp);
@@ -87,3 +110,95 @@ void jmptab_merge(jmptab_t *dest, jmptab_t *src) {
     jmp = jmp->next;
   }
 }
+
+void jmp_begin() { branches.len = 0; }
+
+int branch_cmp(const void *a, const void *b) {
+  size_t la = ((const branch_t *)a)->loc;
+  size_t lb = ((const branch_t *)b)->loc;
+  return la < lb ? -1 : la > lb;
+}
+
+// Tallies what every branch saves at its current size
+void sum_shrunk() {
+  shrunk.len = 0;
+  VEC_RESERVE(shrunk, branches.len + 1);
+  size_t total = 0;
+  for (size_t i = 0; i < branches.len; ++i) {
+    shrunk.data[shrunk.len++] = total;
+    total += near_size(branches.data[i].op) - branches.data[i].size;
+  }
+  shrunk.data[shrunk.len++] = total;
+}
+
+size_t jmp_moved(size_t pos) {
+  // Only the branches before pos move it, one starting at pos doesn't
+  size_t lo = 0, hi = branches.len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (branches.data[mid].loc < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return pos - shrunk.data[lo];
+}
+
+void write_branch(uint8_t *at, const branch_t *branch, int32_t disp) {
+  if (branch->size == SHORT_JMP_SIZE) {
+    instr_set_opcode(short_jmps[branch->op]);
+    instr_set_disp8((uint8_t)disp);
+  } else {
+    instr_set_opcode(branch->op);
+    instr_set_disp32((uint32_t)disp);
+  }
+  uint8_t *instr;
+  uint8_t size = instr_flush(&instr);
+  memcpy(at, instr, size);
+}
+
+size_t jmp_relax(uint8_t *code, size_t start, size_t end) {
+  qsort(branches.data, branches.len, sizeof(branch_t), branch_cmp);
+
+  // Everything starts as short as it can be. Growing a branch only ever puts
+  // others further from where they go, so growing the ones that don't reach
+  // until none are left settles.
+  for (size_t i = 0; i < branches.len; ++i) {
+    branch_t *branch = &branches.data[i];
+    bool next = branch->dest == branch->loc + near_size(branch->op);
+    branch->size = next ? 0 : SHORT_JMP_SIZE;
+  }
+  bool grew = true;
+  while (grew) {
+    grew = false;
+    sum_shrunk();
+    for (size_t i = 0; i < branches.len; ++i) {
+      branch_t *branch = &branches.data[i];
+      if (branch->size != SHORT_JMP_SIZE)
+        continue;
+      size_t from = branch->loc - shrunk.data[i] + SHORT_JMP_SIZE;
+      int64_t disp = (int64_t)jmp_moved(branch->dest) - (int64_t)from;
+      if (disp < INT8_MIN || disp > INT8_MAX) {
+        branch->size = near_size(branch->op);
+        grew = true;
+      }
+    }
+  }
+
+  // Nothing moves up, so the code can be slid down one piece at a time
+  size_t out = start, in = start;
+  for (size_t i = 0; i < branches.len; ++i) {
+    const branch_t *branch = &branches.data[i];
+    memmove(code + out, code + in, branch->loc - in);
+    out += branch->loc - in;
+    in = branch->loc + near_size(branch->op);
+    if (branch->size == 0)
+      continue;
+    size_t from = out + branch->size;
+    int32_t disp = (int32_t)((int64_t)jmp_moved(branch->dest) - (int64_t)from);
+    write_branch(code + out, branch, disp);
+    out += branch->size;
+  }
+  memmove(code + out, code + in, end - in);
+  return out + end - in;
+}
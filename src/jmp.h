@@ -2,6 +2,7 @@
 #define _JMP_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "instr.h"
 
@@ -33,4 +34,13 @@ void jmptab_free(jmptab_t *tab);
 void jmptab_merge(jmptab_t *dest, jmptab_t *src);
 void jmptab_print(jmptab_t *tab);
 
+// Jumps are written near, with rel32, since where they go usually isn't known
+// yet. Every jump patched since jmp_begin() is kept, and once the code they're
+// in is complete jmp_relax() shrinks the ones that reach with rel8, dropping
+// those that go to the very next instruction. The code is compacted in place
+// and its new end returned, jmp_moved() tells where anything else went.
+void jmp_begin();
+size_t jmp_relax(uint8_t *code, size_t start, size_t end);
+size_t jmp_moved(size_t pos);
+
 #endif
@@ -1,11 +1,12 @@
 #include "lex.h"
+#include "scan.h"
 
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 char *token_type_names[] = {[TOKEN_NONE] = "no token",
                             [TOKEN_AT] = "@",
@@ -23,6 +24,7 @@ char *token_type_names[] = {[TOKEN_NONE] = "no token",
                             [TOKEN_OP_EQU] = "=",
                             [TOKEN_LOG_AND] = "&&",
                             [TOKEN_LOG_OR] = "||",
+                            [TOKEN_LOG_NEG] = "!",
                             [TOKEN_CMP_LT] = "<",
                             [TOKEN_CMP_LTE] = "<=",
                             [TOKEN_CMP_GT] = ">",
@@ -35,10 +37,76 @@ char *token_type_names[] = {[TOKEN_NONE] = "no token",
                             [TOKEN_KW_DEC] = "dec",
                             [TOKEN_KW_IF] = "if",
                             [TOKEN_KW_WHILE] = "while",
+                            [TOKEN_KW_CONT] = "cont",
+                            [TOKEN_KW_BREAK] = "break",
                             [TOKEN_TYPE_INT] = "int_type",
                             [TOKEN_EOF] = "EOF"};
 
-FILE *src_fd = NULL;
+typedef struct _keyword {
+  const char *str;
+  size_t len;
+  token_type_t type;
+} keyword_t;
+
+#define KEYWORD(LITERAL, TYPE) {LITERAL, sizeof(LITERAL) - 1, TYPE}
+
+// Perfect hash over the keyword set, checked to be collision free for the
+// keywords below. Adding a keyword means re-checking it.
+#define KEYWORD_HASH(STR, LEN)                                                 \
+  (((unsigned char)(STR)[0] ^ (unsigned char)(STR)[(LEN) - 1] ^ (LEN)) & 15)
+
+static const keyword_t keywords[16] = {
+    [5] = KEYWORD("ret", TOKEN_KW_RET),   [4] = KEYWORD("dec", TOKEN_KW_DEC),
+    [13] = KEYWORD("if", TOKEN_KW_IF),    [7] = KEYWORD("while", TOKEN_KW_WHILE),
+    [3] = KEYWORD("cont", TOKEN_KW_CONT), [12] = KEYWORD("break", TOKEN_KW_BREAK),
+    [14] = KEYWORD("int", TOKEN_TYPE_INT),
+};
+
+// Operators and punctuation are recognized by a two state DFA: the first
+// char picks a state, which either stops there or is extended by one more
+// char into a two char token
+typedef struct _op_state {
+  token_type_t single; // TOKEN_NONE if the char can't stand on its own
+  char next;
+  token_type_t extended;
+} op_state_t;
+
+static const op_state_t op_dfa[128] = {
+    ['@'] = {TOKEN_AT, 0, TOKEN_NONE},
+    [','] = {TOKEN_COMMA, 0, TOKEN_NONE},
+    [':'] = {TOKEN_COLON, 0, TOKEN_NONE},
+    [';'] = {TOKEN_SEMICOLON, 0, TOKEN_NONE},
+    ['('] = {TOKEN_PAREN_LEFT, 0, TOKEN_NONE},
+    [')'] = {TOKEN_PAREN_RIGHT, 0, TOKEN_NONE},
+    ['{'] = {TOKEN_BRACE_LEFT, 0, TOKEN_NONE},
+    ['}'] = {TOKEN_BRACE_RIGHT, 0, TOKEN_NONE},
+    ['+'] = {TOKEN_OP_ADD, 0, TOKEN_NONE},
+    ['-'] = {TOKEN_OP_SUB, 0, TOKEN_NONE},
+    ['*'] = {TOKEN_OP_MUL, 0, TOKEN_NONE},
+    ['/'] = {TOKEN_OP_DIV, 0, TOKEN_NONE},
+    ['='] = {TOKEN_OP_EQU, '=', TOKEN_CMP_EQU},
+    ['!'] = {TOKEN_LOG_NEG, '=', TOKEN_CMP_NEQ},
+    ['<'] = {TOKEN_CMP_LT, '=', TOKEN_CMP_LTE},
+    ['>'] = {TOKEN_CMP_GT, '=', TOKEN_CMP_GTE},
+    ['&'] = {TOKEN_NONE, '&', TOKEN_LOG_AND},
+    ['|'] = {TOKEN_NONE, '|', TOKEN_LOG_OR},
+};
+
+// Source that is still being read, only set when streaming
+typedef struct _token_stream {
+  int fd;
+  char *buf;
+  size_t cap;
+  size_t start; // First unconsumed byte in buf
+  size_t end;   // One past the last byte read into buf
+  size_t base;  // Source offset of buf[0]
+  bool eof;
+} token_stream_t;
+
+// Each thread has its own input, so several can lex and parse at once
+_Thread_local token_array_t *tokens = NULL;
+_Thread_local size_t tok_pos = 0;
+_Thread_local token_stream_t *stream = NULL;
 
 bool is_valid_identifier(char c) {
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
@@ -46,6 +114,10 @@ bool is_valid_identifier(char c) {
 
 bool is_valid_number(char c) { return (c >= '0' && c <= '9'); }
 
+bool is_valid_ident_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
 void print_token(const token_t *token) {
   printf("('%s'", token_type_names[token->type]);
   switch (token->type) {
@@ -53,7 +125,7 @@ void print_token(const token_t *token) {
     printf(": %ld", token->value.int64);
     break;
   case TOKEN_IDENTIFIER:
-    printf(": \"%s\"", token->value.str);
+    printf(": \"%s\"", ident_str(token->value.ident));
     break;
   default:
     break;
@@ -61,157 +133,301 @@ void print_token(const token_t *token) {
   printf(")");
 }
 
-long lex_get_pos() { return ftell(src_fd); }
-int lex_set_pos(long pos) { return fseek(src_fd, pos, SEEK_SET); }
-void set_source_file(FILE *fd) { src_fd = fd; }
+/* Tokenizer */
+
+token_t *array_get(token_array_t *arr, size_t index) {
+  if (index >= arr->len)
+    return NULL;
+  return &arr->data[index];
+}
+
+token_t *array_push(token_array_t *arr) {
+  if (arr->len == arr->alloc_len) {
+    arr->alloc_len *= 2;
+    arr->data = realloc(arr->data, arr->alloc_len * sizeof(token_t));
+    if (arr->data == NULL)
+      err(EXIT_FAILURE, "failed to grow token array");
+  }
+  return &arr->data[arr->len++];
+}
 
-#define MATCHES(TYPE, LITERAL)                                                 \
-  case TYPE: {                                                                 \
-    char content[sizeof(LITERAL)] = {0};                                       \
-    fread(content, sizeof(char), sizeof(LITERAL) - 1, src_fd);                 \
-    if (strncmp(content, LITERAL, sizeof(LITERAL) - 1) != 0) {                 \
-      fseek(src_fd, -((long)sizeof(LITERAL) - 1), SEEK_CUR);                   \
-      return false;                                                            \
-    }                                                                          \
-    break;                                                                     \
+// A sign directly in front of a digit belongs to the number unless the
+// previous token could end an operand, in which case it's an operator
+// (`a -1` is a subtraction, `ret -1` is a literal)
+bool ends_operand(const token_array_t *arr) {
+  if (arr->len == 0)
+    return false;
+  switch (arr->data[arr->len - 1].type) {
+  case TOKEN_IDENTIFIER:
+  case TOKEN_INT:
+  case TOKEN_PAREN_RIGHT:
+    return true;
+  default:
+    return false;
   }
+}
+
+const char *lex_int(const char *cur, const char *end, bool final,
+                    token_t *tok) {
+  bool negative = false;
+  uint64_t i = 0;
+
+  if (*cur == '-' || *cur == '+')
+    negative = *cur++ == '-';
+
+  const char *digits_end = scan_digits(cur, end);
+  if (digits_end == end && !final)
+    return NULL;
 
-// Similar to MATCHES, but fails if following char is identifier char
-// We can safely leave the preceding char unchecked because identifiers will
-// 'consume' the keyword and keywords will have already failed
-#define MATCHES_KW(TYPE, LITERAL)                                              \
-  case TYPE: {                                                                 \
-    char content[sizeof(LITERAL) + 1] = {0};                                   \
-    fread(content, sizeof(char), sizeof(LITERAL), src_fd);                     \
-    if (strncmp(content, LITERAL, sizeof(LITERAL) - 2) != 0 ||                 \
-        is_valid_ident_char(content[sizeof(LITERAL) - 1])) {                   \
-      fseek(src_fd, -((long)sizeof(LITERAL)), SEEK_CUR);                       \
-      return false;                                                            \
-    }                                                                          \
-    fseek(src_fd, -1, SEEK_CUR);                                               \
-    break;                                                                     \
+  for (; cur != digits_end; ++cur) {
+    uint64_t digit = (uint64_t)(*cur - '0');
+    if (i > (INT64_MAX - digit) / 10)
+      errx(EXIT_FAILURE, "error: integer literal out of range at char %zu",
+           tok->pos);
+    i = i * 10 + digit;
   }
 
-#define MATCHES_CHR(TYPE, CHR)                                                 \
-  case TYPE: {                                                                 \
-    int content = fgetc(src_fd);                                               \
-    if (content != CHR) {                                                      \
-      fseek(src_fd, -1, SEEK_CUR);                                             \
-      return false;                                                            \
-    }                                                                          \
-    break;                                                                     \
+  tok->type = TOKEN_INT;
+  tok->value.int64 = negative ? -(int64_t)i : (int64_t)i;
+  return cur;
+}
+
+const char *lex_word(const char *cur, const char *end, bool final,
+                     token_t *tok) {
+  const char *start = cur;
+  cur = scan_ident(cur, end);
+  if (cur == end && !final)
+    return NULL;
+  size_t len = (size_t)(cur - start);
+
+  const keyword_t *kw = &keywords[KEYWORD_HASH(start, len)];
+  if (kw->len == len && memcmp(kw->str, start, len) == 0) {
+    tok->type = kw->type;
+    return cur;
   }
 
-bool is_valid_ident_char(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+  tok->type = TOKEN_IDENTIFIER;
+  tok->value.ident = intern(start, len);
+  return cur;
 }
 
-void skip_whitespace() {
-  int c;
-  do {
-    c = fgetc(src_fd);
-  } while (isspace(c) && c != EOF);
-  ungetc(c, src_fd);
+const char *lex_op(const char *cur, const char *end, bool final,
+                   token_t *tok) {
+  const op_state_t *state = &op_dfa[(unsigned char)*cur];
+  if (state->next != 0 && cur + 1 == end && !final)
+    return NULL;
+  if (state->next != 0 && cur + 1 != end && cur[1] == state->next) {
+    tok->type = state->extended;
+    return cur + 2;
+  }
+  tok->type = state->single;
+  return cur + 1;
 }
 
-token_value_t *try_parse_token_value(token_type_t type) {
-  long prevpos = lex_get_pos();
-  skip_whitespace();
-  token_value_t *value = malloc(sizeof(token_value_t));
-  switch (type) {
-  case TOKEN_INT: {
-    char content[16] = {0};
-    char *endptr;
-
-    // Read 15 chars
-    fread(content, sizeof(char), sizeof(content) - 1, src_fd);
-
-    // Parse int
-    errno = 0;
-    long i = strtol(content, &endptr, 10);
-    if (i == 0 && (errno != 0 || endptr - content == 0))
-      goto fail;
-    value->int64 = i;
-
-    // Seek back to right after num
-    fseek(src_fd, (endptr - content) - (long)strlen(content), SEEK_CUR);
-    break;
+// Lexes the token at cur, which must not be whitespace. If the token could
+// run past end and final isn't set, returns NULL so the caller can read more
+// and retry.
+const char *lex_one(const char *cur, const char *end, bool final,
+                    bool operand_before, token_t *tok) {
+  char c = *cur;
+  if (is_valid_ident_char(c))
+    return lex_word(cur, end, final, tok);
+  if (is_valid_number(c))
+    return lex_int(cur, end, final, tok);
+  if (c == '-' || c == '+') {
+    if (cur + 1 == end && !final)
+      return NULL;
+    if (!operand_before && cur + 1 != end && is_valid_number(cur[1]))
+      return lex_int(cur, end, final, tok);
   }
-  case TOKEN_IDENTIFIER: {
-    char content[32] = {0};
-    unsigned int len;
+  if ((unsigned char)c < sizeof(op_dfa) / sizeof(op_state_t))
+    cur = lex_op(cur, end, final, tok);
+  else
+    tok->type = TOKEN_NONE;
+
+  if (cur != NULL && tok->type == TOKEN_NONE)
+    errx(EXIT_FAILURE, "error: unexpected character '%c' at char %zu", c,
+         tok->pos);
+  return cur;
+}
+
+token_array_t *token_array_init(size_t alloc_len) {
+  token_array_t *arr = malloc(sizeof(token_array_t));
+  arr->alloc_len = alloc_len;
+  arr->len = 0;
+  arr->data = malloc(arr->alloc_len * sizeof(token_t));
+  return arr;
+}
+
+token_array_t *parse_tokens_at(const char *str, size_t size, size_t base) {
+  // Most tokens are a few chars plus whitespace, so this rarely grows
+  token_array_t *arr = token_array_init(size / 4 + 16);
+
+  if (scan_whitespace == NULL)
+    scan_select(SCAN_AUTO);
 
-    // Read 15 chars
-    fread(content, sizeof(char), sizeof(content) - 1, src_fd);
+  const char *cur = str;
+  const char *end = str + size;
+  while (true) {
+    cur = scan_whitespace(cur, end);
 
-    // Find end of string
-    for (len = 0; len < sizeof(content); ++len) {
-      if (!is_valid_ident_char(content[len])) {
-        break;
+    bool operand_before = ends_operand(arr);
+    token_t *tok = array_push(arr);
+    tok->pos = base + (size_t)(cur - str);
+    tok->value.int64 = 0;
+
+    if (cur == end) {
+      tok->type = TOKEN_EOF;
+      break;
+    }
+
+    cur = lex_one(cur, end, true, operand_before, tok);
+  }
+  return arr;
+}
+
+token_array_t *parse_tokens(const char *str, size_t size) {
+  return parse_tokens_at(str, size, 0);
+}
+
+/* Streaming */
+
+void stream_fill(token_stream_t *s) {
+  size_t left = s->end - s->start;
+
+  // A single token fills the whole window, make room for the rest of it
+  if (left == s->cap) {
+    s->cap *= 2;
+    s->buf = realloc(s->buf, s->cap);
+    if (s->buf == NULL)
+      err(EXIT_FAILURE, "failed to grow input window");
+  }
+
+  // Slide what's left to the front, it's all the lexer still needs
+  memmove(s->buf, s->buf + s->start, left);
+  s->base += s->start;
+  s->start = 0;
+  s->end = left;
+
+  ssize_t n;
+  do {
+    n = read(s->fd, s->buf + s->end, s->cap - s->end);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0)
+    err(EXIT_FAILURE, "failed to read input");
+  if (n == 0)
+    s->eof = true;
+  s->end += (size_t)n;
+}
+
+void stream_next_token(token_stream_t *s, token_array_t *arr) {
+  while (true) {
+    const char *end = s->buf + s->end;
+    const char *cur = scan_whitespace(s->buf + s->start, end);
+    s->start = (size_t)(cur - s->buf);
+
+    token_t tok = {.pos = s->base + s->start};
+    if (cur == end) {
+      if (!s->eof) {
+        stream_fill(s);
+        continue;
       }
+      tok.type = TOKEN_EOF;
+      *array_push(arr) = tok;
+      return;
     }
 
-    if (len == 0)
-      goto fail;
+    const char *next = lex_one(cur, end, s->eof, ends_operand(arr), &tok);
+    if (next == NULL) {
+      stream_fill(s);
+      continue;
+    }
+    s->start = (size_t)(next - s->buf);
+    *array_push(arr) = tok;
+    return;
+  }
+}
 
-    // If identifier parsed, set the value
-    char *ident = calloc(len, sizeof(char));
-    strncpy(ident, content, len);
-    ident[len] = '\0';
-    value->str = ident;
+void set_token_stream(int fd, size_t window) {
+  if (scan_whitespace == NULL)
+    scan_select(SCAN_AUTO);
 
-    // Seek back
-    fseek(src_fd, len - (long)strlen(content), SEEK_CUR);
+  stream = calloc(1, sizeof(token_stream_t));
+  stream->fd = fd;
+  stream->cap = window;
+  stream->buf = malloc(window);
+  if (stream->buf == NULL)
+    err(EXIT_FAILURE, "failed to allocate input window");
 
-    break;
+  tokens = token_array_init(256);
+  tok_pos = 0;
+}
+
+void token_array_free(token_array_t *arr) {
+  free(arr->data);
+  free(arr);
+}
+
+/* Token stream */
+
+void set_token_array(token_array_t *arr) {
+  tokens = arr;
+  tok_pos = 0;
+  stream = NULL;
+}
+
+// Lexes more of the stream if needed. Past the end, this is the EOF token.
+token_t *tok_at(size_t i) {
+  while (i >= tokens->len) {
+    if (stream == NULL ||
+        (tokens->len != 0 && tokens->data[tokens->len - 1].type == TOKEN_EOF))
+      return &tokens->data[tokens->len - 1];
+    stream_next_token(stream, tokens);
   }
-  default:
+  return &tokens->data[i];
+}
+
+void lex_commit() {
+  if (stream == NULL)
+    return;
+  size_t left = tokens->len - tok_pos;
+  memmove(tokens->data, tokens->data + tok_pos, left * sizeof(token_t));
+  tokens->len = left;
+  tok_pos = 0;
+}
+
+long lex_get_pos() { return (long)tok_pos; }
+int lex_set_pos(long pos) {
+  if (pos < 0 || (size_t)pos > tokens->len)
+    return -1;
+  tok_pos = (size_t)pos;
+  return 0;
+}
+size_t lex_get_src_pos() { return tok_at(tok_pos)->pos; }
+token_type_t lex_peek() { return tok_at(tok_pos)->type; }
+token_type_t lex_peek_next() { return tok_at(tok_pos + 1)->type; }
+void lex_advance() {
+  if (tok_at(tok_pos)->type != TOKEN_EOF)
+    tok_pos++;
+}
+
+token_value_t *try_parse_token_value(token_type_t type) {
+  token_t *tok = tok_at(tok_pos);
+  if (type != TOKEN_INT && type != TOKEN_IDENTIFIER) {
     printf("error: unknown valued token type\n");
-    goto fail;
+    return NULL;
   }
-  return value;
-fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  if (tok->type != type)
+    return NULL;
+  tok_pos++;
+  return &tok->value;
 }
 
 bool try_parse_token(token_type_t type) {
-  skip_whitespace();
-  switch (type) {
-    MATCHES_CHR(TOKEN_EOF, EOF);
-    MATCHES_CHR(TOKEN_AT, '@');
-    MATCHES_CHR(TOKEN_COMMA, ',');
-    MATCHES_CHR(TOKEN_COLON, ':');
-    MATCHES_CHR(TOKEN_SEMICOLON, ';');
-    MATCHES_CHR(TOKEN_PAREN_LEFT, '(');
-    MATCHES_CHR(TOKEN_PAREN_RIGHT, ')');
-    MATCHES_CHR(TOKEN_BRACE_LEFT, '{');
-    MATCHES_CHR(TOKEN_BRACE_RIGHT, '}');
-    MATCHES_CHR(TOKEN_OP_ADD, '+');
-    MATCHES_CHR(TOKEN_OP_SUB, '-');
-    MATCHES_CHR(TOKEN_OP_MUL, '*');
-    MATCHES_CHR(TOKEN_OP_DIV, '/');
-    MATCHES_CHR(TOKEN_OP_EQU, '=');
-    MATCHES_CHR(TOKEN_CMP_GT, '>');
-    MATCHES_CHR(TOKEN_CMP_LT, '<');
-    MATCHES_CHR(TOKEN_LOG_NEG, '!');
-    MATCHES(TOKEN_CMP_GTE, ">=");
-    MATCHES(TOKEN_CMP_LTE, "<=");
-    MATCHES(TOKEN_CMP_EQU, "==");
-    MATCHES(TOKEN_CMP_NEQ, "!=");
-    MATCHES(TOKEN_LOG_AND, "&&");
-    MATCHES(TOKEN_LOG_OR, "||");
-    MATCHES_KW(TOKEN_KW_RET, "ret");
-    MATCHES_KW(TOKEN_KW_DEC, "dec");
-    MATCHES_KW(TOKEN_KW_IF, "if");
-    MATCHES_KW(TOKEN_KW_WHILE, "while");
-    MATCHES_KW(TOKEN_KW_CONT, "cont");
-    MATCHES_KW(TOKEN_KW_BREAK, "break");
-    MATCHES_KW(TOKEN_TYPE_INT, "int");
-  default:
-    printf("error: unknown constant token type: %s (%d)\n",
-           token_type_names[type], type);
+  if (tok_at(tok_pos)->type != type)
     return false;
-  }
+  // Stay on EOF so it can be matched any number of times
+  if (type != TOKEN_EOF)
+    tok_pos++;
   return true;
 }
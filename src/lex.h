@@ -6,6 +6,8 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "intern.h"
+
 extern char *token_type_names[];
 
 typedef enum _token_type {
@@ -42,20 +44,22 @@ typedef enum _token_type {
   TOKEN_KW_BREAK,
   TOKEN_KW_WHILE,
   TOKEN_TYPE_INT,
+  TOKEN_COUNT,
 } token_type_t;
 
 typedef union _token_value {
   int64_t int64;
-  char *str;
+  ident_t ident;
 } token_value_t;
 
 typedef struct _token {
   token_type_t type;
   token_value_t value;
+  size_t pos; // Offset into the source
 } token_t;
 
 typedef struct _token_array {
-  token_t **data;
+  token_t *data;
   size_t alloc_len;
   size_t len;
 } token_array_t;
@@ -66,12 +70,27 @@ typedef enum _try_error {
   TRY_FAIL,
 } try_error_t;
 
+// Input is either lexed up front with parse_tokens() and handed over with
+// set_token_array(), or read from fd through a sliding window of window bytes
+// with set_token_stream(). Streaming only keeps the tokens after the last
+// lex_commit(), so the parser must never lex_set_pos() to before it.
+// The input is per thread.
+void set_token_array(token_array_t *arr);
+void set_token_stream(int fd, size_t window);
+void lex_commit();
+
 long lex_get_pos();
 int lex_set_pos(long pos);
-void set_source_file(FILE *fd);
+size_t lex_get_src_pos();
+token_type_t lex_peek();
+token_type_t lex_peek_next();
+void lex_advance();
 bool try_parse_token(token_type_t type);
 token_value_t *try_parse_token_value(token_type_t type);
-token_array_t *parse_tokens(char *str, size_t size);
+token_array_t *parse_tokens(const char *str, size_t size);
+// For a piece of a larger source, base is where str starts in it
+token_array_t *parse_tokens_at(const char *str, size_t size, size_t base);
+void token_array_free(token_array_t *arr);
 void print_token(const token_t *);
 token_t *array_get(token_array_t *arr, size_t index);
 
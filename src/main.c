@@ -1,58 +1,214 @@
+#include "ast.h"
+#include "cache.h"
 #include "codegen.h"
 #include "instr.h"
 #include "lex.h"
+#include "parallel.h"
 #include "parse.h"
 
+#include <err.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void print_help() { printf("usage: dumc [file]\n"); }
+// Bytes of input kept in memory when compiling from a pipe
+#define STREAM_WINDOW (64 * 1024)
+
+// Smaller files aren't worth starting threads for
+#define PARALLEL_MIN_SIZE (256 * 1024)
+
+void print_help() {
+  printf("usage: dumc [-j threads] [-C cache_dir] [-fomit-frame-pointer]\n"
+         "            [-o object] [file]\n"
+         "\n"
+         "Reads the source from stdin when file is '-'. Pipes are compiled\n"
+         "while they are still being written, keeping at most one function\n"
+         "and a %d KiB window of input in memory.\n"
+         "\n"
+         "Files of %d KiB or more are parsed on threads threads, one per\n"
+         "CPU by default.\n"
+         "\n"
+         "With -C, the parsed AST of a file is kept in cache_dir, keyed by a\n"
+         "hash of its contents. Compiling the same contents again maps it\n"
+         "instead of parsing.\n"
+         "\n"
+         "With -fomit-frame-pointer, functions that call nothing keep their\n"
+         "locals in the red zone below RSP and don't set up RBP.\n",
+         STREAM_WINDOW / 1024, PARALLEL_MIN_SIZE / 1024);
+}
+
+// foo/bar.dum -> bar.o
+char *default_object_name(char *path) {
+  if (strcmp(path, "-") == 0)
+    path = "stdin";
+
+  char *tmp, *name = strtok(path, "/");
+  while (name != NULL) {
+    if ((tmp = strtok(NULL, "/")) == NULL) {
+      name = strtok(name, ".");
+      break;
+    }
+    name = tmp;
+  }
+
+  char *object_name = calloc(strlen(name) + 3, sizeof(char));
+  strcpy(object_name, name);
+  strcat(object_name, ".o");
+  return object_name;
+}
+
+void gen_ast_funcs(const ast_t *ast) {
+  for (size_t i = 0; i < ast->funcs.len; ++i)
+    gen_func(ast, ast->funcs.data[i]);
+}
+
+// Parses the whole file before writing anything, and caches the ASTs in
+// cache_path if it's set
+void compile_parallel(const char *src, size_t src_len, unsigned int threads,
+                      const char *cache_path, uint64_t hash,
+                      const char *object_name) {
+  size_t chunks_len;
+  parse_chunk_t *chunks = parse_parallel(src, src_len, threads, &chunks_len);
+
+  // Report the first error in the source, like a single thread would
+  for (size_t i = 0; i < chunks_len; ++i) {
+    if (chunks[i].failed)
+      errx(EXIT_FAILURE, "error: %s\n", chunks[i].error);
+  }
+
+  if (cache_path != NULL) {
+    const ast_t **asts = malloc(chunks_len * sizeof(ast_t *));
+    for (size_t i = 0; i < chunks_len; ++i)
+      asts[i] = &chunks[i].ast;
+    if (!ast_cache_save(cache_path, hash, src_len, asts, chunks_len))
+      warnx("failed to write AST cache '%s'", cache_path);
+    free(asts);
+  }
+
+  gen_begin();
+  for (size_t i = 0; i < chunks_len; ++i)
+    gen_ast_funcs(&chunks[i].ast);
+  gen_end(object_name);
+  parse_chunks_free(chunks, chunks_len);
+}
+
+void compile_cached(const char *src, size_t src_len, unsigned int threads,
+                    const char *cache_dir, const char *object_name) {
+  uint64_t hash = ast_cache_hash(src, src_len);
+  char *cache_path = ast_cache_path(cache_dir, hash);
+
+  ast_cache_t cache;
+  if (ast_cache_load(cache_path, hash, src_len, &cache)) {
+    gen_begin();
+    for (size_t i = 0; i < cache.asts_len; ++i)
+      gen_ast_funcs(&cache.asts[i]);
+    gen_end(object_name);
+    ast_cache_close(&cache);
+  } else {
+    compile_parallel(src, src_len, threads, cache_path, hash, object_name);
+  }
+  free(cache_path);
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  char *path = NULL;
+  char *object_name = NULL;
+  char *cache_dir = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      object_name = argv[++i];
+    } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "-fomit-frame-pointer") == 0) {
+      gen_omit_frame_pointer(true);
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = strtol(argv[++i], NULL, 10);
+      if (threads < 1) {
+        print_help();
+        return EXIT_FAILURE;
+      }
+    } else if (path == NULL) {
+      path = argv[i];
+    } else {
+      print_help();
+      return EXIT_FAILURE;
+    }
+  }
+  if (path == NULL) {
     print_help();
     return EXIT_FAILURE;
   }
 
-  FILE *fd = fopen(argv[1], "r");
-  if (fd == NULL) {
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0) {
     perror("Failed to read file");
     return EXIT_FAILURE;
   }
 
-  set_source_file(fd);
-  /* // Read 1K */
-  /* char *program_contents = malloc(sizeof(char) * 1024); */
-  /* fread(program_contents, sizeof(char), 1024, fd); */
-  /* fclose(fd); */
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("Failed to stat file");
+    return EXIT_FAILURE;
+  }
 
-  /* // Lex file */
-  /* token_array_t *tokens = */
-  /*     parse_tokens(program_contents, strlen(program_contents)); */
-  /* free(program_contents); */
+  if (object_name == NULL)
+    object_name = default_object_name(path);
 
-  /* // Print tokens */
-  /* for (size_t i = 0; i < tokens->len; ++i) { */
-  /*   print_token(tokens->data[i]); */
-  /* } */
-  /* printf("\n"); */
+  if (S_ISREG(st.st_mode)) {
+    // Map the whole source once, the lexer only ever moves a cursor over it
+    size_t src_len = (size_t)st.st_size;
+    const char *src = "";
+    if (src_len != 0) {
+      src = mmap(NULL, src_len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (src == MAP_FAILED) {
+        perror("Failed to map file");
+        return EXIT_FAILURE;
+      }
+    }
+    close(fd);
 
-  char *tmp, *name = strtok(argv[1], "/");
-  while (name != NULL) {
-    if ((tmp = strtok(NULL, "/")) == NULL) {
-      name = strtok(name, ".");
-      break;
+    if (src_len < PARALLEL_MIN_SIZE)
+      threads = 1;
+
+    if (cache_dir != NULL) {
+      compile_cached(src, src_len, (unsigned int)threads, cache_dir,
+                     object_name);
+      return EXIT_SUCCESS;
     }
-    name = tmp;
+
+    if (threads > 1) {
+      compile_parallel(src, src_len, (unsigned int)threads, NULL, 0,
+                       object_name);
+      return EXIT_SUCCESS;
+    }
+
+    // Lex everything up front, the parser only moves over token indices
+    token_array_t *tokens = parse_tokens(src, src_len);
+    set_token_array(tokens);
+  } else {
+    // Can't seek or size a pipe, lex it as it comes in
+    set_token_stream(fd, STREAM_WINDOW);
   }
 
-  char *object_name = calloc(strlen(name) + 3, sizeof(char));
-  strcpy(object_name, name);
-  strcat(object_name, ".o");
+  ast_t ast;
+  ast_init(&ast);
+  parse_set_ast(&ast);
 
-  function_t **funcs = try_parse_ast();
-  gen_object(funcs, object_name);
+  // Functions are written as soon as they're parsed, so only one function's
+  // AST is alive at a time
+  gen_begin();
+  node_t func;
+  while ((func = try_parse_next_func()) != NODE_NONE) {
+    gen_func(&ast, func);
+    ast_reset(&ast);
+  }
+  gen_end(object_name);
+  ast_free(&ast);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,114 @@
+#include "parallel.h"
+#include "intern.h"
+#include "lex.h"
+#include "parse.h"
+#include "scan.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// More pieces than threads, so a thread that drew small functions can take
+// more work while the others finish theirs
+#define CHUNKS_PER_THREAD 4
+
+typedef struct _parse_job {
+  parse_chunk_t *chunks;
+  size_t chunks_len;
+  atomic_size_t next;
+} parse_job_t;
+
+size_t split_funcs(const char *src, size_t len, parse_chunk_t *chunks,
+                   size_t max_chunks) {
+  size_t n = 0;
+  size_t start = 0;
+  size_t target = len / max_chunks;
+  long depth = 0;
+
+  // Braces are the only nesting in the language and there are no strings or
+  // comments, so an '@' outside of any braces always starts a function
+  for (size_t i = 0; i < len && n + 1 < max_chunks; ++i) {
+    switch (src[i]) {
+    case '{':
+      depth++;
+      break;
+    case '}':
+      depth--;
+      break;
+    case '@':
+      if (depth != 0 || i < target || i == start)
+        break;
+      chunks[n++] = (parse_chunk_t){
+          .src = src + start, .len = i - start, .base = start};
+      start = i;
+      target = i + (len - i) / (max_chunks - n);
+      break;
+    default:
+      break;
+    }
+  }
+  chunks[n++] =
+      (parse_chunk_t){.src = src + start, .len = len - start, .base = start};
+  return n;
+}
+
+void *parse_worker(void *arg) {
+  parse_job_t *job = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->chunks_len) {
+    parse_chunk_t *chunk = &job->chunks[i];
+    token_array_t *tokens = parse_tokens_at(chunk->src, chunk->len, chunk->base);
+    set_token_array(tokens);
+    ast_init(&chunk->ast);
+    parse_set_ast(&chunk->ast);
+    if (!try_parse_ast()) {
+      chunk->failed = true;
+      strncpy(chunk->error, parse_error(), sizeof(chunk->error) - 1);
+    }
+    token_array_free(tokens);
+  }
+  parse_thread_done();
+  intern_thread_done();
+  return NULL;
+}
+
+parse_chunk_t *parse_parallel(const char *src, size_t len, unsigned int threads,
+                              size_t *chunks_len) {
+  // Pick the scanners before anyone races to
+  if (scan_whitespace == NULL)
+    scan_select(SCAN_AUTO);
+
+  size_t max_chunks = (size_t)threads * CHUNKS_PER_THREAD;
+  parse_chunk_t *chunks = calloc(max_chunks, sizeof(parse_chunk_t));
+  if (chunks == NULL)
+    err(EXIT_FAILURE, "failed to allocate parse chunks");
+
+  parse_job_t job = {.chunks = chunks};
+  job.chunks_len = split_funcs(src, len, chunks, max_chunks);
+  atomic_init(&job.next, 0);
+
+  // This thread works too
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  if (workers == NULL)
+    err(EXIT_FAILURE, "failed to allocate workers");
+  for (unsigned int i = 1; i < threads; ++i) {
+    int ret = pthread_create(&workers[i], NULL, parse_worker, &job);
+    if (ret != 0)
+      errx(EXIT_FAILURE, "failed to start parser thread: %s", strerror(ret));
+  }
+  parse_worker(&job);
+  for (unsigned int i = 1; i < threads; ++i)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  *chunks_len = job.chunks_len;
+  return chunks;
+}
+
+void parse_chunks_free(parse_chunk_t *chunks, size_t chunks_len) {
+  for (size_t i = 0; i < chunks_len; ++i)
+    ast_free(&chunks[i].ast);
+  free(chunks);
+}
@@ -0,0 +1,30 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#include "ast.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A run of whole top level functions, parsed on its own
+typedef struct _parse_chunk {
+  const char *src;
+  size_t len;
+  size_t base; // Where src starts in the whole source
+  ast_t ast;
+  bool failed;
+  char error[128];
+} parse_chunk_t;
+
+// Splits src right before top level '@'s into at most max_chunks pieces of
+// about the same size, returns how many there are
+size_t split_funcs(const char *src, size_t len, parse_chunk_t *chunks,
+                   size_t max_chunks);
+
+// Parses src on threads threads. The chunks come back in source order, so
+// going through their ASTs' funcs in turn visits every function in order.
+parse_chunk_t *parse_parallel(const char *src, size_t len, unsigned int threads,
+                              size_t *chunks_len);
+void parse_chunks_free(parse_chunk_t *chunks, size_t chunks_len);
+
+#endif // _PARALLEL_H
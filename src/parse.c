@@ -1,12 +1,34 @@
 #include "parse.h"
+#include "ast.h"
+#include "fold.h"
 #include "lex.h"
+#include "vec.h"
 
 #include <err.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-char error_msg[128] = {0};
+// Parser state is per thread, like the lexer's
+_Thread_local char error_msg[128] = {0};
+_Thread_local ast_t *ast = NULL;
+
+// A position to backtrack to. Rolling back also drops every node that was
+// added after it, since the failed attempt can't be referencing them.
+typedef struct _save_point {
+  long pos;
+  ast_mark_t mark;
+} save_point_t;
+
+save_point_t save_point() {
+  return (save_point_t){.pos = lex_get_pos(), .mark = ast_mark(ast)};
+}
+
+void restore_point(save_point_t point) {
+  lex_set_pos(point.pos);
+  ast_rollback(ast, point.mark);
+}
 
 #define ASSERT_TOKEN(TOKEN_TYPE)                                               \
   do {                                                                         \
@@ -16,6 +38,8 @@ char error_msg[128] = {0};
     }                                                                          \
   } while (0)
 
+// Evaluates to a copy of the value, the token itself may be moved by the
+// lexer once more input is read
 #define ASSERT_TOKEN_VALUE(TOKEN_TYPE)                                         \
   ({                                                                           \
     token_value_t *__assert_token_value_var =                                  \
@@ -24,537 +48,495 @@ char error_msg[128] = {0};
       gen_token_error(TOKEN_TYPE);                                             \
       goto fail;                                                               \
     }                                                                          \
-    __assert_token_value_var;                                                  \
+    *__assert_token_value_var;                                                 \
   })
 
 #define ERRX(STATUS) errx(STATUS, "error: %s\n", error_msg)
 
-expression_t *try_parse_expression();
-arith_expression_t *try_parse_arith_expression();
-code_block_t *try_parse_code_block();
+node_t try_parse_code_block();
 
 void gen_token_error(token_type_t type) {
   snprintf(error_msg, sizeof(error_msg) - 1,
-           "failed to parse token '%s' at char %ld", token_type_names[type],
-           lex_get_pos());
+           "failed to parse token '%s' at char %zu", token_type_names[type],
+           lex_get_src_pos());
 }
 
 type_t try_parse_type() {
   type_t type;
-  long prevpos = lex_get_pos();
+  save_point_t prevpos = save_point();
   if (try_parse_token(TOKEN_TYPE_INT)) {
     type = TYPE_INT64;
   } else {
-    lex_set_pos(prevpos);
+    restore_point(prevpos);
     return TYPE_NONE;
   }
   return type;
 }
 
-vartype_t *try_parse_vartype() {
-  token_value_t *name;
-  type_t type;
-  long prevpos = lex_get_pos();
+bool try_parse_vartype(ident_t *name, type_t *type) {
+  token_value_t value;
+  save_point_t prevpos = save_point();
 
-  name = ASSERT_TOKEN_VALUE(TOKEN_IDENTIFIER);
+  value = ASSERT_TOKEN_VALUE(TOKEN_IDENTIFIER);
   ASSERT_TOKEN(TOKEN_COLON);
-  type = try_parse_type();
+  *type = try_parse_type();
 
-  if (type == TYPE_NONE) {
+  if (*type == TYPE_NONE) {
     gen_token_error(TOKEN_TYPE_INT);
     goto fail;
   }
 
-  vartype_t *vartype = malloc(sizeof(vartype_t));
-  vartype->name = name->str;
-  vartype->type = type;
-  return vartype;
+  *name = value.ident;
+  return true;
 
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  restore_point(prevpos);
+  return false;
 }
 
-bool try_parse_arith_op(arith_operator_t *op) {
-  long prevpos = lex_get_pos();
-  if (try_parse_token(TOKEN_OP_ADD)) {
-    *op = ARITH_OP_ADD;
-  } else if (try_parse_token(TOKEN_OP_SUB)) {
-    *op = ARITH_OP_SUB;
-  } else if (try_parse_token(TOKEN_OP_MUL)) {
-    *op = ARITH_OP_MUL;
-  } else if (try_parse_token(TOKEN_OP_DIV)) {
-    *op = ARITH_OP_DIV;
-  } else {
-    lex_set_pos(prevpos);
-    return false;
-  }
-  return true;
+// Expressions are parsed with operator precedence over two explicit stacks
+// instead of recursion, every token is looked at once and nesting depth is
+// only bounded by memory. Arithmetic, comparisons and boolean operators share
+// one precedence table, operands are type checked by their node kind when an
+// operator is applied to them.
+
+typedef enum _op_class {
+  OPC_NONE,
+  OPC_ARITH,
+  OPC_CMP,
+  OPC_BOOL,
+} op_class_t;
+
+typedef struct _binary_op {
+  op_class_t class;
+  uint8_t prec;
+  uint8_t op; // arith_operator_t, cmp_operator_t or bool_operator_t
+} binary_op_t;
+
+static const binary_op_t binary_ops[TOKEN_COUNT] = {
+    [TOKEN_LOG_OR] = {OPC_BOOL, 1, BOOL_OP_OR},
+    [TOKEN_LOG_AND] = {OPC_BOOL, 2, BOOL_OP_AND},
+    [TOKEN_CMP_EQU] = {OPC_CMP, 3, CMP_OP_EQU},
+    [TOKEN_CMP_NEQ] = {OPC_CMP, 3, CMP_OP_NEQ},
+    [TOKEN_CMP_GTE] = {OPC_CMP, 3, CMP_OP_GTE},
+    [TOKEN_CMP_LTE] = {OPC_CMP, 3, CMP_OP_LTE},
+    [TOKEN_CMP_GT] = {OPC_CMP, 3, CMP_OP_GT},
+    [TOKEN_CMP_LT] = {OPC_CMP, 3, CMP_OP_LT},
+    [TOKEN_OP_ADD] = {OPC_ARITH, 4, ARITH_OP_ADD},
+    [TOKEN_OP_SUB] = {OPC_ARITH, 4, ARITH_OP_SUB},
+    [TOKEN_OP_MUL] = {OPC_ARITH, 5, ARITH_OP_MUL},
+    [TOKEN_OP_DIV] = {OPC_ARITH, 5, ARITH_OP_DIV},
+};
+
+typedef enum _frame_type {
+  FRAME_BINARY,
+  FRAME_NOT, // '!' binds tighter than any binary operator
+  FRAME_PAREN,
+  FRAME_CALL,
+} frame_type_t;
+
+typedef struct _frame {
+  frame_type_t type;
+  const binary_op_t *op; // FRAME_BINARY
+  ident_t name;          // FRAME_CALL
+  size_t args_base;      // FRAME_CALL, where its arguments start in operands
+} frame_t;
+
+_Thread_local VEC(node_t) operands = {0};
+_Thread_local VEC(frame_t) frames = {0};
+
+void gen_parse_error(const char *what) {
+  snprintf(error_msg, sizeof(error_msg) - 1, "%s at char %zu", what,
+           lex_get_src_pos());
 }
 
-bool try_parse_cmp_op(cmp_operator_t *op) {
-  long prevpos = lex_get_pos();
-  if (try_parse_token(TOKEN_CMP_EQU)) {
-    *op = CMP_OP_EQU;
-  } else if (try_parse_token(TOKEN_CMP_GTE)) {
-    *op = CMP_OP_GTE;
-  } else if (try_parse_token(TOKEN_CMP_LTE)) {
-    *op = CMP_OP_LTE;
-  } else if (try_parse_token(TOKEN_CMP_NEQ)) {
-    *op = CMP_OP_NEQ;
-  } else if (try_parse_token(TOKEN_CMP_GT)) {
-    *op = CMP_OP_GT;
-  } else if (try_parse_token(TOKEN_CMP_LT)) {
-    *op = CMP_OP_LT;
-  } else {
-    lex_set_pos(prevpos);
-    return false;
+// Applies the operator on top of the frame stack to the operands under it
+bool reduce_frame() {
+  frame_t frame = frames.data[--frames.len];
+
+  if (frame.type == FRAME_NOT) {
+    node_t *operand = &operands.data[operands.len - 1];
+    *operand = ast_add(ast, NODE_BOOL, BOOL_OP_NOT, *operand, NODE_NONE);
+    return true;
   }
-  return true;
-}
 
-bool try_parse_bool_op(bool_operator_t *op) {
-  long prevpos = lex_get_pos();
-  if (try_parse_token(TOKEN_LOG_AND)) {
-    *op = BOOL_OP_AND;
-  } else if (try_parse_token(TOKEN_LOG_OR)) {
-    *op = BOOL_OP_OR;
-  } else if (try_parse_token(TOKEN_LOG_NEG)) {
-    *op = BOOL_OP_NOT;
-  } else {
-    lex_set_pos(prevpos);
-    return false;
+  node_t rhs = operands.data[--operands.len];
+  node_t lhs = operands.data[operands.len - 1];
+  node_kind_t kind;
+
+  switch (frame.op->class) {
+  case OPC_ARITH:
+    if (!ast_is_arith(ast, lhs) || !ast_is_arith(ast, rhs)) {
+      gen_parse_error("arithmetic on a boolean expression");
+      return false;
+    }
+    kind = NODE_ARITH;
+    break;
+  case OPC_CMP:
+    if (!ast_is_arith(ast, lhs) || !ast_is_arith(ast, rhs)) {
+      gen_parse_error("comparison of a boolean expression");
+      return false;
+    }
+    kind = NODE_CMP;
+    break;
+  case OPC_BOOL:
+    kind = NODE_BOOL;
+    break;
+  default:
+    errx(EXIT_FAILURE, "reduce_frame(): unknown operator");
   }
+  operands.data[operands.len - 1] = ast_add(ast, kind, frame.op->op, lhs, rhs);
   return true;
 }
 
-uint8_t bool_op_precedence(bool_operator_t op) {
-  switch (op) {
-  case BOOL_OP_NOT:
-    return 3;
-  case BOOL_OP_AND:
-    return 2;
-  case BOOL_OP_OR:
-    return 1;
+// Reduces every operator above the innermost open group (or base), returns
+// false on a type error
+bool reduce_group(size_t base) {
+  while (frames.len > base && (frames.data[frames.len - 1].type == FRAME_BINARY ||
+                               frames.data[frames.len - 1].type == FRAME_NOT)) {
+    if (!reduce_frame())
+      return false;
   }
-  errx(EXIT_FAILURE, "bool_op_precedence(): unknown operator");
+  return true;
 }
 
-uint8_t arith_op_precedence(arith_operator_t op) {
-  switch (op) {
-  case ARITH_OP_MUL:
-  case ARITH_OP_DIV:
-    return 2;
-  case ARITH_OP_ADD:
-  case ARITH_OP_SUB:
-    return 1;
-  }
-  errx(EXIT_FAILURE, "arith_op_precedence(): unknown operator");
+// Replaces the finished arguments on top of the operand stack with the call
+void push_call(ident_t name, size_t args_base) {
+  uint32_t argc = (uint32_t)(operands.len - args_base);
+  uint32_t args = ast_add_extra(ast, &argc, 1);
+  ast_add_extra(ast, operands.data + args_base, argc);
+  operands.len = args_base;
+  VEC_PUSH(operands, ast_add(ast, NODE_CALL, 0, name, args));
 }
 
-func_call_t *try_parse_func_call() {
-  long prevpos = lex_get_pos();
-  token_value_t *name;
-
-  expression_t **args = calloc(MAX_FUNC_ARGS, sizeof(expression_t *));
-  unsigned int argc = 0;
-
-  name = ASSERT_TOKEN_VALUE(TOKEN_IDENTIFIER);
-  ASSERT_TOKEN(TOKEN_PAREN_LEFT);
-
-  expression_t *expr;
-  if (!try_parse_token(TOKEN_PAREN_RIGHT)) {
-    if ((expr = try_parse_expression()) == NULL)
-      goto fail;
-    args[argc++] = expr;
-    while (try_parse_token(TOKEN_COMMA)) {
-      if ((expr = try_parse_expression()) == NULL)
-        goto fail;
-      args[argc++] = expr;
+bool try_parse_operand(size_t *open_groups) {
+  token_value_t *value;
+  switch (lex_peek()) {
+  case TOKEN_INT:
+    value = try_parse_token_value(TOKEN_INT);
+    VEC_PUSH(operands, ast_add_num(ast, value->int64));
+    return true;
+  case TOKEN_IDENTIFIER: {
+    ident_t name = try_parse_token_value(TOKEN_IDENTIFIER)->ident;
+    if (!try_parse_token(TOKEN_PAREN_LEFT)) {
+      VEC_PUSH(operands, ast_add(ast, NODE_IDENT, 0, name, 0));
+      return true;
     }
-    ASSERT_TOKEN(TOKEN_PAREN_RIGHT);
+    if (try_parse_token(TOKEN_PAREN_RIGHT)) {
+      push_call(name, operands.len);
+      return true;
+    }
+    VEC_PUSH(frames, ((frame_t){.type = FRAME_CALL,
+                                .name = name,
+                                .args_base = operands.len}));
+    (*open_groups)++;
+    return false;
   }
-  func_call_t *call = malloc(sizeof(func_call_t));
-  call->name = name->str;
-  call->args = args;
-  return call;
-fail:
-  lex_set_pos(prevpos);
-  return NULL;
-}
-
-arith_expression_t *try_parse_arith_atom() {
-  long prevpos = lex_get_pos();
-  arith_expression_t *expr = malloc(sizeof(arith_expression_t));
-  token_value_t *value;
-  func_call_t *call;
-  if ((call = try_parse_func_call()) != NULL) {
-    expr->instance.func_call = call;
-    expr->type = ARITH_FUNC_CALL;
-  } else if ((value = try_parse_token_value(TOKEN_IDENTIFIER)) != NULL) {
-    expr->instance.name = value->str;
-    expr->type = ARITH_IDENT;
-  } else if ((value = try_parse_token_value(TOKEN_INT)) != NULL) {
-    expr->instance.int64 = value->int64;
-    expr->type = ARITH_NUM;
-  } else if (try_parse_token(TOKEN_PAREN_LEFT)) {
-    arith_expression_t *subexpr;
-    if ((subexpr = try_parse_arith_expression()) == NULL)
-      goto fail;
-    ASSERT_TOKEN(TOKEN_PAREN_RIGHT);
-
-    expr->instance.expr = subexpr;
-    expr->type = ARITH_EXPR;
-  } else {
-    goto fail;
+  case TOKEN_PAREN_LEFT:
+    lex_advance();
+    VEC_PUSH(frames, ((frame_t){.type = FRAME_PAREN}));
+    (*open_groups)++;
+    return false;
+  case TOKEN_LOG_NEG:
+    lex_advance();
+    VEC_PUSH(frames, ((frame_t){.type = FRAME_NOT}));
+    return false;
+  default:
+    gen_parse_error("expected expression");
+    *open_groups = SIZE_MAX;
+    return false;
   }
-  return expr;
-fail:
-  free(expr);
-  lex_set_pos(prevpos);
-  return NULL;
 }
 
-// Pratt parsing!
-arith_expression_t *try_parse_arith_expression_bp(uint8_t min_prec) {
-  long prevpos = lex_get_pos();
-  arith_expression_t *lhs;
-  arith_expression_t *rhs;
-
-  if ((lhs = try_parse_arith_atom()) == NULL)
-    goto fail;
+node_t try_parse_expression() {
+  size_t operand_base = operands.len;
+  size_t frame_base = frames.len;
+  size_t open_groups = 0;
+  save_point_t prevpos = save_point();
 
   while (true) {
-    arith_operator_t oprtr;
-    long back = lex_get_pos();
-    if (!try_parse_arith_op(&oprtr)) {
-      lex_set_pos(back);
-      break;
+    // Prefix position: keep going until a complete operand is on the stack
+    if (!try_parse_operand(&open_groups)) {
+      if (open_groups == SIZE_MAX)
+        goto fail;
+      continue;
     }
 
-    uint8_t prec = arith_op_precedence(oprtr);
-    if (prec <= min_prec) {
-      lex_set_pos(back);
-      break;
+    // Postfix position: a binary operator, or the end of a group, or the end
+    // of the expression
+    while (true) {
+      token_type_t type = lex_peek();
+      const binary_op_t *op = &binary_ops[type];
+
+      if (op->class != OPC_NONE) {
+        while (frames.len > frame_base) {
+          frame_t *top = &frames.data[frames.len - 1];
+          if (top->type == FRAME_NOT ||
+              (top->type == FRAME_BINARY && top->op->prec >= op->prec)) {
+            if (!reduce_frame())
+              goto fail;
+          } else {
+            break;
+          }
+        }
+        lex_advance();
+        VEC_PUSH(frames, ((frame_t){.type = FRAME_BINARY, .op = op}));
+        break;
+      }
+
+      if (open_groups == 0 ||
+          (type != TOKEN_PAREN_RIGHT && type != TOKEN_COMMA))
+        goto done;
+
+      if (!reduce_group(frame_base))
+        goto fail;
+      frame_t *group = &frames.data[frames.len - 1];
+      lex_advance();
+
+      if (type == TOKEN_COMMA) {
+        if (group->type != FRAME_CALL) {
+          gen_token_error(TOKEN_PAREN_RIGHT);
+          goto fail;
+        }
+        // The argument stays on the operand stack until the call is closed
+        break;
+      }
+
+      open_groups--;
+      frames.len--;
+      if (group->type == FRAME_CALL) {
+        push_call(group->name, group->args_base);
+        continue;
+      }
+
+      node_t *inner = &operands.data[operands.len - 1];
+      *inner = ast_add(ast, ast_is_arith(ast, *inner) ? NODE_PAREN : NODE_GROUP,
+                       0, *inner, 0);
     }
-
-    if ((rhs = try_parse_arith_expression_bp(prec)) == NULL)
-      goto fail;
-
-    arith_operation_t *op = malloc(sizeof(arith_operation_t));
-    op->op = oprtr;
-    op->lhs = lhs;
-    op->rhs = rhs;
-    lhs = malloc(sizeof(arith_expression_t));
-    lhs->type = ARITH_OP;
-    lhs->instance.op = op;
   }
-  return lhs;
-fail:
-  lex_set_pos(prevpos);
-  return NULL;
-}
-
-arith_expression_t *try_parse_arith_expression() {
-  return try_parse_arith_expression_bp(0);
-}
-
-cmp_operation_t *try_parse_cmp_operation() {
-  long prevpos = lex_get_pos();
-  arith_expression_t *lhs;
-  arith_expression_t *rhs;
-  cmp_operator_t op;
-  if ((lhs = try_parse_arith_expression()) == NULL)
-    goto fail;
-  if (!try_parse_cmp_op(&op))
-    goto fail;
-  if ((rhs = try_parse_arith_expression()) == NULL)
-    goto fail;
-  cmp_operation_t *cmp = malloc(sizeof(cmp_operation_t));
-  cmp->lhs = lhs;
-  cmp->rhs = rhs;
-  cmp->op = op;
-  return cmp;
-fail:
-  lex_set_pos(prevpos);
-  return NULL;
-}
-
-expression_t *try_parse_expr_atom() {
-  long prevpos = lex_get_pos();
-  expression_t *expr = malloc(sizeof(expression_t));
-  arith_expression_t *aexpr;
-  cmp_operation_t *cmp;
-  if ((cmp = try_parse_cmp_operation()) != NULL) {
-    expr->type = EXPR_CMP;
-    expr->instance.cmp = cmp;
-  } else if ((aexpr = try_parse_arith_expression()) != NULL) {
-    expr->type = EXPR_ARITH;
-    expr->instance.aexpr = aexpr;
-  } else if (try_parse_token(TOKEN_PAREN_LEFT)) {
-    expression_t *subexpr;
-    if ((subexpr = try_parse_expression()) == NULL)
-      goto fail;
-    ASSERT_TOKEN(TOKEN_PAREN_RIGHT);
-    expr->type = EXPR_EXPR;
-    expr->instance.expr = subexpr;
-  } else if (try_parse_token(TOKEN_LOG_NEG) &&
-             try_parse_token(TOKEN_PAREN_LEFT)) {
-    expression_t *subexpr;
-    if ((subexpr = try_parse_expression()) == NULL)
-      goto fail;
-    ASSERT_TOKEN(TOKEN_PAREN_RIGHT);
 
-    bool_operation_t *op = malloc(sizeof(bool_operation_t));
-    op->op = BOOL_OP_NOT;
-    op->lhs = subexpr;
-    op->rhs = NULL;
-
-    expr->type = EXPR_BOOL;
-    expr->instance.bop = op;
-  } else {
+done:
+  if (open_groups != 0) {
+    gen_token_error(TOKEN_PAREN_RIGHT);
     goto fail;
   }
-  return expr;
-fail:
-  free(expr);
-  lex_set_pos(prevpos);
-  return NULL;
-}
-
-expression_t *try_parse_expression_bp(uint8_t min_prec) {
-  long prevpos = lex_get_pos();
-  expression_t *lhs;
-  expression_t *rhs;
-
-  if ((lhs = try_parse_expr_atom()) == NULL)
+  if (!reduce_group(frame_base))
     goto fail;
+  return operands.data[--operands.len];
 
-  while (true) {
-    bool_operator_t oprtr;
-    long back = lex_get_pos();
-    if (!try_parse_bool_op(&oprtr)) {
-      lex_set_pos(back);
-      break;
-    }
-
-    uint8_t prec = bool_op_precedence(oprtr);
-    if (prec <= min_prec) {
-      lex_set_pos(back);
-      break;
-    }
-
-    if ((rhs = try_parse_expression_bp(prec)) == NULL)
-      goto fail;
-
-    bool_operation_t *op = malloc(sizeof(bool_operation_t));
-    op->op = oprtr;
-    op->lhs = lhs;
-    op->rhs = rhs;
-    lhs = malloc(sizeof(expression_t));
-    lhs->type = EXPR_BOOL;
-    lhs->instance.bop = op;
-  }
-  return lhs;
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  operands.len = operand_base;
+  frames.len = frame_base;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-expression_t *try_parse_expression() { return try_parse_expression_bp(0); }
-
-while_statement_t *try_parse_while_loop() {
-  long prevpos = lex_get_pos();
-  expression_t *cond;
-  code_block_t *code_block;
+node_t try_parse_while_loop() {
+  save_point_t prevpos = save_point();
+  node_t cond;
+  node_t code_block;
 
   ASSERT_TOKEN(TOKEN_KW_WHILE);
-  if ((cond = try_parse_expression()) == NULL)
+  if ((cond = try_parse_expression()) == NODE_NONE)
     goto fail;
-  if ((code_block = try_parse_code_block()) == NULL)
+  if ((code_block = try_parse_code_block()) == NODE_NONE)
     goto fail;
-  while_statement_t *stmt = malloc(sizeof(while_statement_t));
-  stmt->code_block = code_block;
-  stmt->cond = cond;
-  return stmt;
+  return ast_add(ast, NODE_WHILE, 0, cond, code_block);
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-cond_statement_t *try_parse_cond_statement() {
-  long prevpos = lex_get_pos();
-  expression_t *cond;
-  code_block_t *code_block;
+node_t try_parse_cond_statement() {
+  save_point_t prevpos = save_point();
+  node_t cond;
+  node_t code_block;
 
   ASSERT_TOKEN(TOKEN_KW_IF);
-  if ((cond = try_parse_expression()) == NULL)
+  if ((cond = try_parse_expression()) == NODE_NONE)
     goto fail;
-  if ((code_block = try_parse_code_block()) == NULL)
+  if ((code_block = try_parse_code_block()) == NODE_NONE)
     goto fail;
-
-  cond_statement_t *stmt = malloc(sizeof(cond_statement_t));
-  stmt->code_block = code_block;
-  stmt->cond = cond;
-  return stmt;
+  return ast_add(ast, NODE_IF, 0, cond, code_block);
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-declare_statement_t *try_parse_dec_statement() {
-  long prevpos = lex_get_pos();
-  vartype_t *type;
-  expression_t *expr;
+node_t try_parse_dec_statement() {
+  save_point_t prevpos = save_point();
+  ident_t name;
+  type_t type;
+  node_t expr;
 
   ASSERT_TOKEN(TOKEN_KW_DEC);
-  if ((type = try_parse_vartype()) == NULL)
+  if (!try_parse_vartype(&name, &type))
     goto fail;
   ASSERT_TOKEN(TOKEN_OP_EQU);
 
-  if ((expr = try_parse_expression()) == NULL)
+  if ((expr = try_parse_expression()) == NODE_NONE)
     goto fail;
 
-  declare_statement_t *stmt = malloc(sizeof(declare_statement_t));
-  stmt->expr = expr;
-  stmt->name = type->name;
-  stmt->type = type->type;
-  return stmt;
+  return ast_add(ast, NODE_DECLARE, type, name, expr);
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-ret_statement_t *try_parse_ret_statement() {
-  long prevpos = lex_get_pos();
-  expression_t *expr;
+node_t try_parse_ret_statement() {
+  save_point_t prevpos = save_point();
+  node_t expr;
 
   ASSERT_TOKEN(TOKEN_KW_RET);
 
-  if ((expr = try_parse_expression()) == NULL)
+  if ((expr = try_parse_expression()) == NODE_NONE)
     goto fail;
 
-  ret_statement_t *stmt = malloc(sizeof(ret_statement_t));
-  stmt->expr = expr;
-  return stmt;
+  return ast_add(ast, NODE_RET, 0, expr, 0);
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-assign_statement_t *try_parse_assign_statement() {
-  long prevpos = lex_get_pos();
-  token_value_t *value;
-  expression_t *expr;
+node_t try_parse_assign_statement() {
+  save_point_t prevpos = save_point();
+  token_value_t value;
+  node_t expr;
 
   value = ASSERT_TOKEN_VALUE(TOKEN_IDENTIFIER);
   ASSERT_TOKEN(TOKEN_OP_EQU);
 
-  if ((expr = try_parse_expression()) == NULL)
+  if ((expr = try_parse_expression()) == NODE_NONE)
     goto fail;
 
-  assign_statement_t *stmt = malloc(sizeof(assign_statement_t));
-  stmt->expr = expr;
-  stmt->lhs = value->str;
-  return stmt;
+  return ast_add(ast, NODE_ASSIGN, 0, value.ident, expr);
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-statement_t *try_parse_statement() {
-  statement_t *stmt = malloc(sizeof(statement_t));
-  if ((stmt->instance.declare = try_parse_dec_statement()) != NULL) {
-    stmt->type = STMT_DECLARE;
-  } else if ((stmt->instance.ret = try_parse_ret_statement()) != NULL) {
-    stmt->type = STMT_RET;
-  } else if ((stmt->instance.assign = try_parse_assign_statement()) != NULL) {
-    stmt->type = STMT_ASSIGN;
-  } else if ((stmt->instance.cond = try_parse_cond_statement()) != NULL) {
-    stmt->type = STMT_COND;
-  } else if ((stmt->instance.while_loop = try_parse_while_loop()) != NULL) {
-    stmt->type = STMT_WHILE;
-  } else if (try_parse_token(TOKEN_KW_CONT)) {
-    stmt->type = STMT_CONT;
-  } else if (try_parse_token(TOKEN_KW_BREAK)) {
-    stmt->type = STMT_BREAK;
-  } else if ((stmt->instance.expr = try_parse_expression()) != NULL) {
-    stmt->type = STMT_EXPR;
-  } else {
-    return NULL;
+node_t try_parse_statement() {
+  switch (lex_peek()) {
+  case TOKEN_KW_DEC:
+    return try_parse_dec_statement();
+  case TOKEN_KW_RET:
+    return try_parse_ret_statement();
+  case TOKEN_KW_IF:
+    return try_parse_cond_statement();
+  case TOKEN_KW_WHILE:
+    return try_parse_while_loop();
+  case TOKEN_KW_CONT:
+    lex_advance();
+    return ast_add(ast, NODE_CONT, 0, 0, 0);
+  case TOKEN_KW_BREAK:
+    lex_advance();
+    return ast_add(ast, NODE_BREAK, 0, 0, 0);
+  case TOKEN_IDENTIFIER:
+    if (lex_peek_next() == TOKEN_OP_EQU)
+      return try_parse_assign_statement();
+    // Otherwise it's the start of an expression
+    // fall through
+  default:
+    return try_parse_expression();
   }
-  return stmt;
 }
 
-code_block_t *try_parse_code_block() {
-  statement_t **stmts = calloc(25, sizeof(statement_t));
-  long prevpos = lex_get_pos();
-  unsigned int i = 0;
+// Statements of the blocks being parsed, a nested block pushes on top of its
+// parent's and pops them again once they're copied into the AST
+_Thread_local VEC(node_t) block_stmts = {0};
+
+node_t try_parse_code_block() {
+  save_point_t prevpos = save_point();
+  size_t base = block_stmts.len;
 
   ASSERT_TOKEN(TOKEN_BRACE_LEFT);
   while (!try_parse_token(TOKEN_BRACE_RIGHT)) {
-    statement_t *stmt = try_parse_statement();
-    if (stmt == NULL)
+    node_t stmt = try_parse_statement();
+    if (stmt == NODE_NONE)
       goto fail;
-    stmts[i++] = stmt;
+    VEC_PUSH(block_stmts, stmt);
   }
 
-  code_block_t *code_block = malloc(sizeof(code_block_t));
-  code_block->statements = stmts;
-  return code_block;
+  uint32_t len = (uint32_t)(block_stmts.len - base);
+  uint32_t stmts = ast_add_extra(ast, block_stmts.data + base, len);
+  block_stmts.len = base;
+  return ast_add(ast, NODE_BLOCK, 0, stmts, len);
 fail:
-  lex_set_pos(prevpos);
-  return NULL;
+  block_stmts.len = base;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-function_t *try_parse_func() {
-  token_value_t *name;
-  code_block_t *code_block;
-  vartype_t **args = calloc(MAX_FUNC_ARGS, sizeof(vartype_t *));
-  unsigned int argc = 0;
-  long prevpos = lex_get_pos();
+// Name and type of every argument, in the layout NODE_FUNC keeps them in
+_Thread_local VEC(uint32_t) func_args = {0};
+
+node_t try_parse_func() {
+  token_value_t name;
+  node_t code_block;
+  save_point_t prevpos = save_point();
+  func_args.len = 0;
 
   ASSERT_TOKEN(TOKEN_AT);
   name = ASSERT_TOKEN_VALUE(TOKEN_IDENTIFIER);
   ASSERT_TOKEN(TOKEN_PAREN_LEFT);
 
-  vartype_t *vartype;
+  ident_t arg_name;
+  type_t arg_type;
   if (!try_parse_token(TOKEN_PAREN_RIGHT)) {
-    if ((vartype = try_parse_vartype()) == NULL)
-      goto fail;
-    args[argc++] = vartype;
-    while (try_parse_token(TOKEN_COMMA)) {
-      if ((vartype = try_parse_vartype()) == NULL)
+    do {
+      if (!try_parse_vartype(&arg_name, &arg_type))
         goto fail;
-      args[argc++] = vartype;
-    }
+      VEC_PUSH(func_args, arg_name);
+      VEC_PUSH(func_args, arg_type);
+    } while (try_parse_token(TOKEN_COMMA));
     ASSERT_TOKEN(TOKEN_PAREN_RIGHT);
   }
 
-  if ((code_block = try_parse_code_block()) == NULL)
+  if ((code_block = try_parse_code_block()) == NODE_NONE)
     goto fail;
 
-  function_t *func = malloc(sizeof(function_t));
-  func->name = name->str;
-  func->args = args;
-  func->code_block = code_block;
+  uint32_t header[2] = {code_block, (uint32_t)(func_args.len / 2)};
+  uint32_t extra = ast_add_extra(ast, header, 2);
+  ast_add_extra(ast, func_args.data, func_args.len);
+  node_t func = ast_add(ast, NODE_FUNC, 0, name.ident, extra);
+  VEC_PUSH(ast->funcs, func);
+  fold_func(ast, func);
   return func;
 
 fail:
-  free(args);
-  lex_set_pos(prevpos);
-  return NULL;
+  restore_point(prevpos);
+  return NODE_NONE;
 }
 
-function_t **try_parse_ast() {
-  function_t **funcs = calloc(10, sizeof(function_t *));
-  unsigned int i = 0;
+void parse_set_ast(ast_t *tree) { ast = tree; }
+
+// The parser never rewinds past the start of the function it's working on,
+// so everything before it can be dropped from the token stream. Returns
+// NODE_NONE once the whole input has been parsed.
+node_t try_parse_next_func() {
+  if (try_parse_token(TOKEN_EOF))
+    return NODE_NONE;
+
+  node_t func = try_parse_func();
+  if (func == NODE_NONE)
+    ERRX(EXIT_FAILURE);
+  lex_commit();
+  return func;
+}
 
+bool try_parse_ast() {
   while (!try_parse_token(TOKEN_EOF)) {
-    function_t *func = try_parse_func();
-    if (func == NULL)
-      ERRX(EXIT_FAILURE);
-    funcs[i++] = func;
+    if (try_parse_func() == NODE_NONE)
+      return false;
   }
-  return funcs;
+  return true;
+}
+
+const char *parse_error() { return error_msg; }
+
+void parse_thread_done() {
+  VEC_FREE(operands);
+  VEC_FREE(frames);
+  VEC_FREE(block_stmts);
+  VEC_FREE(func_args);
 }
@@ -0,0 +1,266 @@
+#include "regalloc.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Nothing but a call writes to these, so a variable in one never has to be
+// saved or moved: callee-saved registers outlive calls, R10 and R11 only go
+// to variables that don't live across one. Argument, return and division
+// registers are left to expressions.
+reg_t call_safe_regs[] = {RBX, R12, R13, R14, R15};
+reg_t scratch_regs[] = {R10, R11, RBX, R12, R13, R14, R15};
+
+typedef struct _shadowed {
+  ident_t name;
+  uint32_t var;
+} shadowed_t;
+
+typedef struct _loop {
+  node_t first;
+  node_t last;
+} loop_t;
+
+// Indexed by ident_t, the variable the name refers to plus one, 0 if none
+uint32_t *ident_vars;
+size_t ident_vars_len;
+// What every declaration replaced, undone at the end of its block
+VEC(shadowed_t) declared;
+VEC(node_t) calls;
+VEC(loop_t) loops;
+// Variables used by the expression being walked
+VEC(uint32_t) touched;
+
+void touch_var(regalloc_t *ra, ident_t name, node_t at) {
+  if (name >= ident_vars_len || ident_vars[name] == 0)
+    return;
+  var_alloc_t *var = &ra->vars.data[ident_vars[name] - 1];
+  if (at > var->end)
+    var->end = at;
+  VEC_PUSH(touched, ident_vars[name] - 1);
+}
+
+void declare_var(regalloc_t *ra, ident_t name, node_t at) {
+  if (name >= ident_vars_len) {
+    size_t len = ident_count() > name ? ident_count() : name + 1;
+    ident_vars = realloc(ident_vars, len * sizeof(uint32_t));
+    if (ident_vars == NULL)
+      err(EXIT_FAILURE, "failed to grow ident_vars");
+    memset(ident_vars + ident_vars_len, 0,
+           (len - ident_vars_len) * sizeof(uint32_t));
+    ident_vars_len = len;
+  }
+  VEC_PUSH(declared, ((shadowed_t){name, ident_vars[name]}));
+  VEC_PUSH(ra->vars, ((var_alloc_t){.start = at, .end = at}));
+  ident_vars[name] = (uint32_t)ra->vars.len;
+}
+
+void walk_live(regalloc_t *ra, const ast_t *ast, node_t node);
+
+// Codegen works out calls before the rest of an expression, so a variable
+// it uses may well be read after the last of them
+void walk_expr(regalloc_t *ra, const ast_t *ast, node_t expr) {
+  size_t first_call = calls.len;
+  touched.len = 0;
+  walk_live(ra, ast, expr);
+  if (calls.len == first_call)
+    return;
+  node_t last_call = calls.data[calls.len - 1];
+  for (size_t i = 0; i < touched.len; ++i) {
+    var_alloc_t *var = &ra->vars.data[touched.data[i]];
+    if (var->end < last_call)
+      var->end = last_call;
+  }
+}
+
+// Visits nodes in the order codegen writes them
+void walk_live(regalloc_t *ra, const ast_t *ast, node_t node) {
+  switch (ast->kind[node]) {
+  case NODE_IDENT:
+    touch_var(ra, ast->lhs[node], node);
+    break;
+  case NODE_CALL:
+    for (uint32_t i = 0; i < ast_call_argc(ast, node); ++i)
+      walk_live(ra, ast, ast_call_arg(ast, node, i));
+    VEC_PUSH(calls, node);
+    break;
+  case NODE_ARITH:
+  case NODE_CMP:
+    walk_live(ra, ast, ast->lhs[node]);
+    walk_live(ra, ast, ast->rhs[node]);
+    break;
+  case NODE_IF:
+    walk_expr(ra, ast, ast->lhs[node]);
+    walk_live(ra, ast, ast->rhs[node]);
+    break;
+  case NODE_BOOL:
+    walk_live(ra, ast, ast->lhs[node]);
+    if (ast->rhs[node] != NODE_NONE)
+      walk_live(ra, ast, ast->rhs[node]);
+    break;
+  case NODE_PAREN:
+  case NODE_GROUP:
+    walk_live(ra, ast, ast->lhs[node]);
+    break;
+  case NODE_RET:
+    walk_expr(ra, ast, ast->lhs[node]);
+    break;
+  case NODE_DECLARE:
+    walk_expr(ra, ast, ast->rhs[node]);
+    declare_var(ra, ast->lhs[node], node);
+    break;
+  case NODE_ASSIGN:
+    walk_expr(ra, ast, ast->rhs[node]);
+    touch_var(ra, ast->lhs[node], node);
+    break;
+  case NODE_WHILE:
+    walk_expr(ra, ast, ast->lhs[node]);
+    walk_live(ra, ast, ast->rhs[node]);
+    VEC_PUSH(loops, ((loop_t){ast_first(ast, node), node}));
+    break;
+  case NODE_BLOCK: {
+    size_t mark = declared.len;
+    for (uint32_t i = 0; i < ast->rhs[node]; ++i) {
+      node_t stmt = ast_block_stmt(ast, node, i);
+      if (ast_is_arith(ast, stmt))
+        walk_expr(ra, ast, stmt);
+      else
+        walk_live(ra, ast, stmt);
+    }
+    while (declared.len > mark) {
+      shadowed_t shadowed = declared.data[--declared.len];
+      ident_vars[shadowed.name] = shadowed.var;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+bool crosses_call(const var_alloc_t *var) {
+  // Calls are in node order, find the first one after the start. Parameters
+  // start at 0, which is also where a call in the first statement may be.
+  size_t lo = 0, hi = calls.len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (calls.data[mid] < var->start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // A variable can end on a call, when it's read after it
+  return lo < calls.len && calls.data[lo] <= var->end;
+}
+
+void regalloc_func(regalloc_t *ra, const ast_t *ast, node_t func) {
+  ra->vars.len = 0;
+  ra->spilled = 0;
+  calls.len = 0;
+  loops.len = 0;
+
+  uint32_t argc = ast_func_argc(ast, func);
+  for (uint32_t i = 0; i < argc; ++i)
+    declare_var(ra, ast_func_arg_name(ast, func, i), 0);
+  walk_live(ra, ast, ast_func_block(ast, func));
+  ra->leaf = calls.len == 0;
+  while (declared.len > 0) {
+    shadowed_t shadowed = declared.data[--declared.len];
+    ident_vars[shadowed.name] = shadowed.var;
+  }
+
+  // A variable from before a loop that's used inside it is needed again on
+  // the next iteration. Loops were found innermost first, so stretching into
+  // one loop is seen by the loops around it.
+  for (size_t l = 0; l < loops.len; ++l) {
+    for (size_t i = 0; i < ra->vars.len; ++i) {
+      var_alloc_t *var = &ra->vars.data[i];
+      if (var->start < loops.data[l].first &&
+          var->end >= loops.data[l].first && var->end < loops.data[l].last)
+        var->end = loops.data[l].last;
+    }
+  }
+
+  // Variables were declared in node order, so they're already sorted by start
+  uint32_t active[NUM_REGISTERS];
+  size_t active_len = 0;
+  bool taken[NUM_REGISTERS] = {0};
+  for (uint32_t i = 0; i < ra->vars.len; ++i) {
+    var_alloc_t *var = &ra->vars.data[i];
+    var->crosses_call = crosses_call(var);
+    var->reg = NUM_REGISTERS;
+
+    for (size_t a = 0; a < active_len;) {
+      var_alloc_t *other = &ra->vars.data[active[a]];
+      if (other->end < var->start) {
+        taken[other->reg] = false;
+        active[a] = active[--active_len];
+      } else {
+        ++a;
+      }
+    }
+
+    const reg_t *pool = var->crosses_call ? call_safe_regs : scratch_regs;
+    size_t pool_len = var->crosses_call
+                          ? sizeof(call_safe_regs) / sizeof(reg_t)
+                          : sizeof(scratch_regs) / sizeof(reg_t);
+    for (size_t p = 0; p < pool_len; ++p) {
+      if (!taken[pool[p]]) {
+        var->reg = pool[p];
+        break;
+      }
+    }
+
+    if (var->reg == NUM_REGISTERS) {
+      // Out of registers, whichever variable lives longest goes to memory
+      size_t victim = active_len;
+      for (size_t a = 0; a < active_len; ++a) {
+        const var_alloc_t *other = &ra->vars.data[active[a]];
+        bool fits = false;
+        for (size_t p = 0; p < pool_len; ++p)
+          fits |= pool[p] == other->reg;
+        if (fits && other->end > var->end &&
+            (victim == active_len ||
+             other->end > ra->vars.data[active[victim]].end))
+          victim = a;
+      }
+      if (victim == active_len) {
+        ra->spilled++;
+        continue;
+      }
+      var->reg = ra->vars.data[active[victim]].reg;
+      ra->vars.data[active[victim]].reg = NUM_REGISTERS;
+      active[victim] = active[--active_len];
+      ra->spilled++;
+    }
+
+    taken[var->reg] = true;
+    active[active_len++] = i;
+  }
+
+  for (int r = 0; r < NUM_REGISTERS; ++r)
+    ra->by_reg[r].len = 0;
+  regalloc_rewind(ra);
+  for (uint32_t i = 0; i < ra->vars.len; ++i) {
+    if (ra->vars.data[i].reg != NUM_REGISTERS)
+      VEC_PUSH(ra->by_reg[ra->vars.data[i].reg], i);
+  }
+}
+
+void regalloc_rewind(regalloc_t *ra) {
+  for (int r = 0; r < NUM_REGISTERS; ++r)
+    ra->cursor[r] = 0;
+}
+
+void regalloc_live(regalloc_t *ra, node_t first, node_t last,
+                   bool live[NUM_REGISTERS]) {
+  for (int r = 0; r < NUM_REGISTERS; ++r) {
+    // A register's variables don't overlap, and are in order
+    while (ra->cursor[r] < ra->by_reg[r].len &&
+           ra->vars.data[ra->by_reg[r].data[ra->cursor[r]]].end < first)
+      ra->cursor[r]++;
+    if (ra->cursor[r] < ra->by_reg[r].len &&
+        ra->vars.data[ra->by_reg[r].data[ra->cursor[r]]].start <= last)
+      live[r] = true;
+  }
+}
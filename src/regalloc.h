@@ -0,0 +1,39 @@
+#ifndef _REGALLOC_H
+#define _REGALLOC_H
+
+#include "ast.h"
+#include "instr.h"
+#include "vec.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Where a variable lives for its whole life
+typedef struct _var_alloc {
+  node_t start; // Where it's declared, 0 for parameters
+  node_t end;   // Its last use, or the end of the last loop it's used in
+  bool crosses_call;
+  reg_t reg; // NUM_REGISTERS when it stays in its frame slot
+} var_alloc_t;
+
+// Variables are numbered in the order codegen meets them: the parameters,
+// then every dec in source order
+typedef struct _regalloc {
+  VEC(var_alloc_t) vars;
+  size_t spilled; // Variables without a register
+  bool leaf;      // The function calls nothing
+  VEC(uint32_t) by_reg[NUM_REGISTERS]; // Variables given each register
+  size_t cursor[NUM_REGISTERS];
+} regalloc_t;
+
+// Linear scan over the variables of func
+void regalloc_func(regalloc_t *ra, const ast_t *ast, node_t func);
+// Marks the registers holding a variable anywhere from first to last. Calls
+// must ask about later and later nodes.
+void regalloc_live(regalloc_t *ra, node_t first, node_t last,
+                   bool live[NUM_REGISTERS]);
+// Lets regalloc_live() start over from the first node, for writing the
+// function again
+void regalloc_rewind(regalloc_t *ra);
+
+#endif // _REGALLOC_H
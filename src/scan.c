@@ -0,0 +1,166 @@
+#include "scan.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+char *scan_impl_names[] = {[SCAN_AUTO] = "auto",
+                           [SCAN_SCALAR] = "scalar",
+                           [SCAN_SSE2] = "sse2",
+                           [SCAN_AVX2] = "avx2"};
+
+scan_fn_t scan_whitespace = NULL;
+scan_fn_t scan_ident = NULL;
+scan_fn_t scan_digits = NULL;
+
+/* Scalar */
+
+// Same set as isspace() in the C locale
+static inline bool is_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool is_ident(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static const char *scalar_whitespace(const char *cur, const char *end) {
+  while (cur != end && is_space(*cur))
+    ++cur;
+  return cur;
+}
+
+static const char *scalar_ident(const char *cur, const char *end) {
+  while (cur != end && is_ident(*cur))
+    ++cur;
+  return cur;
+}
+
+static const char *scalar_digits(const char *cur, const char *end) {
+  while (cur != end && is_digit(*cur))
+    ++cur;
+  return cur;
+}
+
+#ifdef SCAN_X86
+
+/* SSE2 */
+
+// Bytes >= 0x80 compare as negative, so none of the classes below match them
+#define SSE2_RANGE(V, LO, HI)                                                  \
+  _mm_and_si128(_mm_cmpgt_epi8((V), _mm_set1_epi8((char)((LO) - 1))),         \
+                _mm_cmplt_epi8((V), _mm_set1_epi8((char)((HI) + 1))))
+
+static inline __m128i sse2_space(__m128i v) {
+  return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                      SSE2_RANGE(v, '\t', '\r'));
+}
+
+static inline __m128i sse2_ident(__m128i v) {
+  // Folding case maps only letters onto 'a'..'z'
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  return _mm_or_si128(SSE2_RANGE(lower, 'a', 'z'),
+                      _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+static inline __m128i sse2_digit(__m128i v) { return SSE2_RANGE(v, '0', '9'); }
+
+#define SSE2_SCAN(NAME, CLASSIFY, SCALAR)                                      \
+  static const char *NAME(const char *cur, const char *end) {                  \
+    while (end - cur >= 16) {                                                  \
+      __m128i v = _mm_loadu_si128((const __m128i *)cur);                       \
+      unsigned int mask = (unsigned int)_mm_movemask_epi8(CLASSIFY(v));        \
+      if (mask != 0xFFFF)                                                      \
+        return cur + __builtin_ctz(~mask);                                     \
+      cur += 16;                                                               \
+    }                                                                          \
+    return SCALAR(cur, end);                                                   \
+  }
+
+SSE2_SCAN(sse2_whitespace, sse2_space, scalar_whitespace)
+SSE2_SCAN(sse2_ident_run, sse2_ident, scalar_ident)
+SSE2_SCAN(sse2_digits, sse2_digit, scalar_digits)
+
+/* AVX2 */
+
+#define AVX2_RANGE(V, LO, HI)                                                  \
+  _mm256_and_si256(                                                            \
+      _mm256_cmpgt_epi8((V), _mm256_set1_epi8((char)((LO) - 1))),              \
+      _mm256_cmpgt_epi8(_mm256_set1_epi8((char)((HI) + 1)), (V)))
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_space(__m256i v) {
+  return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                         AVX2_RANGE(v, '\t', '\r'));
+}
+
+static inline AVX2 __m256i avx2_ident(__m256i v) {
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  return _mm256_or_si256(AVX2_RANGE(lower, 'a', 'z'),
+                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+static inline AVX2 __m256i avx2_digit(__m256i v) {
+  return AVX2_RANGE(v, '0', '9');
+}
+
+// Short runs are the common case, so finish with the 16 byte version
+#define AVX2_SCAN(NAME, CLASSIFY, TAIL)                                        \
+  static AVX2 const char *NAME(const char *cur, const char *end) {             \
+    while (end - cur >= 32) {                                                  \
+      __m256i v = _mm256_loadu_si256((const __m256i *)cur);                    \
+      unsigned int mask = (unsigned int)_mm256_movemask_epi8(CLASSIFY(v));     \
+      if (mask != 0xFFFFFFFF)                                                  \
+        return cur + __builtin_ctz(~mask);                                     \
+      cur += 32;                                                               \
+    }                                                                          \
+    return TAIL(cur, end);                                                     \
+  }
+
+AVX2_SCAN(avx2_whitespace, avx2_space, sse2_whitespace)
+AVX2_SCAN(avx2_ident_run, avx2_ident, sse2_ident_run)
+AVX2_SCAN(avx2_digits, avx2_digit, sse2_digits)
+
+#endif // SCAN_X86
+
+scan_impl_t scan_select(scan_impl_t impl) {
+  if (impl == SCAN_AUTO) {
+    impl = SCAN_SCALAR;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      impl = SCAN_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+      impl = SCAN_SSE2;
+#endif
+  }
+
+  switch (impl) {
+#ifdef SCAN_X86
+  case SCAN_AVX2:
+    scan_whitespace = avx2_whitespace;
+    scan_ident = avx2_ident_run;
+    scan_digits = avx2_digits;
+    break;
+  case SCAN_SSE2:
+    scan_whitespace = sse2_whitespace;
+    scan_ident = sse2_ident_run;
+    scan_digits = sse2_digits;
+    break;
+#endif
+  default:
+    impl = SCAN_SCALAR;
+    scan_whitespace = scalar_whitespace;
+    scan_ident = scalar_ident;
+    scan_digits = scalar_digits;
+    break;
+  }
+  return impl;
+}
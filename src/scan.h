@@ -0,0 +1,24 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+
+typedef enum _scan_impl {
+  SCAN_AUTO,
+  SCAN_SCALAR,
+  SCAN_SSE2,
+  SCAN_AVX2,
+} scan_impl_t;
+
+extern char *scan_impl_names[];
+
+// Returns the first char in [cur, end) that isn't part of the run
+typedef const char *(*scan_fn_t)(const char *cur, const char *end);
+
+extern scan_fn_t scan_whitespace;
+extern scan_fn_t scan_ident;
+extern scan_fn_t scan_digits;
+
+scan_impl_t scan_select(scan_impl_t impl);
+
+#endif // _SCAN_H
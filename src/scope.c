@@ -1,46 +1,91 @@
 #include "scope.h"
 
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
 scope_t *scope_init() {
   scope_t *scope = calloc(1, sizeof(scope_t));
   scope->stacksize = 8; // By default 8 because we push rbp for every function
-  if (hashmap_create(8, &scope->map) != 0)
+  scope->vars_len = ident_count() + 16;
+  scope->vars = calloc(scope->vars_len, sizeof(scope_var_t));
+  if (scope->vars == NULL)
     return NULL;
   return scope;
 }
 
-const scope_var_t *scope_insert_immutable(scope_t *scope, char *str,
-                                          uint8_t size, bool immutable) {
-  const scope_var_t *elm =
-      hashmap_get(&scope->map, str, (unsigned int)strlen(str));
-  if (elm != NULL) {
+void scope_reset(scope_t *scope) {
+  for (size_t i = 0; i < scope->inserted_len; ++i)
+    scope->vars[scope->inserted[i]].present = false;
+  scope->inserted_len = 0;
+  scope->stacksize = 8;
+}
+
+const scope_var_t *scope_insert_reg(scope_t *scope, ident_t id, uint8_t size,
+                                    bool immutable, reg_t reg) {
+  if (id >= scope->vars_len) {
+    size_t len = scope->vars_len * 2 > id ? scope->vars_len * 2 : id + 1;
+    scope->vars = realloc(scope->vars, len * sizeof(scope_var_t));
+    if (scope->vars == NULL)
+      err(EXIT_FAILURE, "failed to grow scope");
+    memset(scope->vars + scope->vars_len, 0,
+           (len - scope->vars_len) * sizeof(scope_var_t));
+    scope->vars_len = len;
+  }
+
+  scope_var_t *scope_var = &scope->vars[id];
+  if (scope_var->present) {
     return NULL;
   }
-  scope_var_t *scope_var = malloc(sizeof(scope_var_t));
+
+  if (scope->inserted_len == scope->inserted_cap) {
+    scope->inserted_cap = scope->inserted_cap == 0 ? 16 : scope->inserted_cap * 2;
+    scope->inserted =
+        realloc(scope->inserted, scope->inserted_cap * sizeof(ident_t));
+    if (scope->inserted == NULL)
+      err(EXIT_FAILURE, "failed to grow scope");
+  }
+  scope->inserted[scope->inserted_len++] = id;
+
   scope_var->size = size;
-  scope_var->position = (int32_t)(-scope->stacksize);
+  scope_var->reg = reg;
   scope_var->immutable = immutable;
+  scope_var->present = true;
 
-  scope->stacksize += size;
-  hashmap_put(&scope->map, str, (unsigned int)strlen(str), scope_var);
+  if (reg == NUM_REGISTERS) {
+    scope_var->position = (int32_t)(-scope->stacksize);
+    scope->stacksize += size;
+  }
 
   return scope_var;
 }
 
-const scope_var_t *scope_insert(scope_t *scope, char *str, uint8_t size) {
-  return scope_insert_immutable(scope, str, size, false);
+const scope_var_t *scope_insert_immutable(scope_t *scope, ident_t id,
+                                          uint8_t size, bool immutable) {
+  return scope_insert_reg(scope, id, size, immutable, NUM_REGISTERS);
 }
 
-bool scope_remove(scope_t *scope, char *str) {
-  return hashmap_remove(&scope->map, str, (unsigned int)strlen(str)) == 0;
+const scope_var_t *scope_insert(scope_t *scope, ident_t id, uint8_t size) {
+  return scope_insert_immutable(scope, id, size, false);
 }
 
-const scope_var_t *scope_get(scope_t *scope, char *str) {
-  const scope_var_t *elm =
-      hashmap_get(&scope->map, str, (unsigned int)strlen(str));
-  return elm;
+bool scope_remove(scope_t *scope, ident_t id) {
+  if (id >= scope->vars_len || !scope->vars[id].present)
+    return false;
+  scope->vars[id].present = false;
+  return true;
 }
 
-scope_t *scope_clone(scope_t *scope) {
-  scope_t *dup = malloc(sizeof(scope_t));
-  return memcpy(dup, scope, sizeof(scope_t));
+size_t scope_mark(scope_t *scope) { return scope->inserted_len; }
+
+void scope_pop_to(scope_t *scope, size_t mark) {
+  for (size_t i = mark; i < scope->inserted_len; ++i)
+    scope->vars[scope->inserted[i]].present = false;
+  scope->inserted_len = mark;
+}
+
+const scope_var_t *scope_get(scope_t *scope, ident_t id) {
+  if (id >= scope->vars_len || !scope->vars[id].present)
+    return NULL;
+  return &scope->vars[id];
 }
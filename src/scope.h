@@ -1,28 +1,44 @@
 #ifndef _SCOPE_H
 #define _SCOPE_H
 
-#include "hashmap.h"
+#include "instr.h"
+#include "intern.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-typedef struct _scope {
-  uint32_t stacksize;
-  hashmap_t map;
-} scope_t;
-
 typedef struct _scope_var {
   int32_t position;
+  reg_t reg; // NUM_REGISTERS when it's on the stack at position
   uint8_t size;
   bool immutable;
+  bool present;
 } scope_var_t;
 
+// Variables are indexed directly by their identifier's ID. Pointers handed
+// out stay valid until the next insert.
+typedef struct _scope {
+  uint32_t stacksize;
+  scope_var_t *vars;
+  size_t vars_len;
+  ident_t *inserted; // So a reset only touches what was added
+  size_t inserted_len;
+  size_t inserted_cap;
+} scope_t;
+
 scope_t *scope_init();
-const scope_var_t *scope_insert(scope_t *scope, char *str, uint8_t size);
-const scope_var_t *scope_insert_immutable(scope_t *scope, char *str,
+void scope_reset(scope_t *scope);
+const scope_var_t *scope_insert(scope_t *scope, ident_t id, uint8_t size);
+const scope_var_t *scope_insert_immutable(scope_t *scope, ident_t id,
                                           uint8_t size, bool immutable);
-const scope_var_t *scope_get(scope_t *scope, char *str);
-scope_t *scope_clone(scope_t *scope);
-bool scope_remove(scope_t *scope, char *str);
+// A variable kept in reg takes no stack space
+const scope_var_t *scope_insert_reg(scope_t *scope, ident_t id, uint8_t size,
+                                    bool immutable, reg_t reg);
+const scope_var_t *scope_get(scope_t *scope, ident_t id);
+bool scope_remove(scope_t *scope, ident_t id);
+// Removes every variable inserted since the mark was taken
+size_t scope_mark(scope_t *scope);
+void scope_pop_to(scope_t *scope, size_t mark);
 
 #endif
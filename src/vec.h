@@ -0,0 +1,42 @@
+#ifndef _VEC_H
+#define _VEC_H
+
+#include <err.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// A growable array, capacity doubles so pushing is amortized O(1)
+#define VEC(TYPE)                                                              \
+  struct {                                                                     \
+    TYPE *data;                                                                \
+    size_t len;                                                                \
+    size_t cap;                                                                \
+  }
+
+#define VEC_RESERVE(VEC, N)                                                    \
+  do {                                                                         \
+    if ((VEC).len + (N) > (VEC).cap) {                                         \
+      size_t __vec_cap = (VEC).cap ? (VEC).cap : 16;                           \
+      while (__vec_cap < (VEC).len + (N))                                      \
+        __vec_cap *= 2;                                                        \
+      (VEC).data = realloc((VEC).data, __vec_cap * sizeof(*(VEC).data));       \
+      if ((VEC).data == NULL)                                                  \
+        err(EXIT_FAILURE, "failed to grow " #VEC);                             \
+      (VEC).cap = __vec_cap;                                                   \
+    }                                                                          \
+  } while (0)
+
+#define VEC_PUSH(VEC, VALUE)                                                   \
+  do {                                                                         \
+    VEC_RESERVE(VEC, 1);                                                       \
+    (VEC).data[(VEC).len++] = (VALUE);                                         \
+  } while (0)
+
+#define VEC_FREE(VEC)                                                          \
+  do {                                                                         \
+    free((VEC).data);                                                          \
+    (VEC).data = NULL;                                                         \
+    (VEC).len = (VEC).cap = 0;                                                 \
+  } while (0)
+
+#endif // _VEC_H